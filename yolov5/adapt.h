@@ -0,0 +1,129 @@
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <bmruntime_interface.h>
+
+#define ADAPT_HIGH      2.0f    // frames behind before stepping down
+#define ADAPT_LOW       0.5f    // frames behind counted as caught up
+#define ADAPT_HOLD      30      // caught up frames before stepping up
+#define ADAPT_COOLDOWN  10      // frames after a switch with no other switch
+#define ADAPT_HEADROOM  0.8f    // share of the frame period the larger stage may take
+
+// stage of a multi-stage bmodel following the load of a source of fixed
+// frame rate. the backlog is how many frames the source has produced that
+// are not processed yet, too many steps down to a smaller stage, caught up
+// for a while steps up if the larger stage is expected to keep up
+struct adapt_ctl {
+    int level_num;
+    int* stages;        // stages by input area, smallest first
+    int* areas;
+    int level;          // current index into stages
+    float period;       // seconds per source frame
+    double start;
+    int frames;
+    double last;
+    float frame_time;   // moving average of the time per frame at this level
+    int calm;           // caught up frames in a row
+    int cooldown;
+
+    // metrics
+    int down_num;
+    int up_num;
+    int* level_frames;  // frames run at each level
+};
+
+double adapt_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// start at the largest stage
+void adapt_ctl_init(struct adapt_ctl* ctl, const bm_net_info_t* info, float fps){
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->level_num = info->stage_num;
+    ctl->stages = (int*)malloc(ctl->level_num * sizeof(int));
+    ctl->areas = (int*)malloc(ctl->level_num * sizeof(int));
+    ctl->level_frames = (int*)calloc(ctl->level_num, sizeof(int));
+    for (int s=0;s<ctl->level_num;s++){
+        const bm_shape_t* shape = &info->stages[s].input_shapes[0];
+        int area = shape->dims[2] * shape->dims[3];
+        int j = s - 1;
+        while (j >= 0 && ctl->areas[j] > area){
+            ctl->stages[j+1] = ctl->stages[j];
+            ctl->areas[j+1] = ctl->areas[j];
+            j--;
+        }
+        ctl->stages[j+1] = s;
+        ctl->areas[j+1] = area;
+    }
+    ctl->level = ctl->level_num - 1;
+    ctl->period = 1.0f / fps;
+    ctl->start = ctl->last = adapt_now();
+}
+
+void adapt_ctl_free(struct adapt_ctl* ctl){
+    free(ctl->stages);
+    free(ctl->areas);
+    free(ctl->level_frames);
+}
+
+int adapt_stage(const struct adapt_ctl* ctl){
+    return ctl->stages[ctl->level];
+}
+
+// account one processed frame, and switch the level for the next one
+void adapt_ctl_update(struct adapt_ctl* ctl){
+    double now = adapt_now();
+    float dt = now - ctl->last;
+    ctl->last = now;
+    ctl->frames++;
+    ctl->level_frames[ctl->level]++;
+    ctl->frame_time = ctl->frame_time == 0 ? dt : 0.9f * ctl->frame_time + 0.1f * dt;
+
+    // a live source has no frame ahead of time, so slack does not add up
+    float backlog = (now - ctl->start) / ctl->period - ctl->frames;
+    if (backlog < 0){
+        ctl->start = now - ctl->frames * ctl->period;
+        backlog = 0;
+    }
+    if (ctl->cooldown > 0){
+        ctl->cooldown--;
+        return;
+    }
+    int from = ctl->level;
+    if (backlog > ADAPT_HIGH && ctl->level > 0){
+        ctl->level--;
+        ctl->down_num++;
+    } else if (backlog < ADAPT_LOW && ctl->level < ctl->level_num - 1){
+        // the time per frame is expected to grow with the input area
+        float next_time = ctl->frame_time * ctl->areas[ctl->level + 1] / ctl->areas[ctl->level];
+        if (++ctl->calm >= ADAPT_HOLD && next_time < ADAPT_HEADROOM * ctl->period){
+            ctl->level++;
+            ctl->up_num++;
+        }
+    } else {
+        ctl->calm = 0;
+    }
+    if (ctl->level != from){
+        printf("adapt: stage %d -> %d, %.1f frames behind, %.2f ms per frame\n",
+                ctl->stages[from], ctl->stages[ctl->level], backlog, ctl->frame_time * 1e3);
+        ctl->frame_time *= (float)ctl->areas[ctl->level] / ctl->areas[from];
+        ctl->calm = 0;
+        ctl->cooldown = ADAPT_COOLDOWN;
+    }
+}
+
+// current mode and switch counts
+void adapt_ctl_report(const struct adapt_ctl* ctl){
+    printf("adapt: stage %d, %d frames, %d down and %d up switches, frames per stage:",
+            adapt_stage(ctl), ctl->frames, ctl->down_num, ctl->up_num);
+    for (int l=0;l<ctl->level_num;l++)
+        printf(" %d:%d", ctl->stages[l], ctl->level_frames[l]);
+    printf("\n");
+}
+#endif
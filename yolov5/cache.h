@@ -0,0 +1,243 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+
+#define CACHE_WAYS          8       // entries per bucket, the least recently used one is evicted
+#define CACHE_ENTRY_BOXES   128     // results with more boxes are not cached
+#define CACHE_MAGIC         0x3148435235564f59ULL
+#define CACHE_VERSION       2       // bump when the layout of the index changes
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const unsigned char* p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const unsigned char* p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input){
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val){
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// XXH64 of little endian hosts, the same values as the reference xxhash
+uint64_t xxh64(const void* data, size_t len, uint64_t seed){
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + len;
+    uint64_t h;
+    if (len >= 32){
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        for (; p + 32 <= end; p += 32){
+            v1 = xxh64_round(v1, xxh_read64(p));
+            v2 = xxh64_round(v2, xxh_read64(p + 8));
+            v3 = xxh64_round(v3, xxh_read64(p + 16));
+            v4 = xxh64_round(v4, xxh_read64(p + 24));
+        }
+        h = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8){
+        h ^= xxh64_round(0, xxh_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end){
+        h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++){
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// map a whole file read only, returns NULL if it cannot be read
+const unsigned char* file_map(const char* path, size_t* size){
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    *size = st.st_size;
+    return (const unsigned char*)p;
+}
+
+void file_unmap(const unsigned char* p, size_t size){
+    munmap((void*)p, size);
+}
+
+struct cache_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t entry_size;    // sizeof(struct cache_entry) of the build that wrote it
+    uint64_t config;        // hash of the settings the results depend on
+    uint32_t bucket_num;
+    uint32_t stamp;         // last use stamp handed out
+};
+
+struct cache_entry {
+    uint64_t hash;          // of the encoded file bytes
+    uint64_t size;
+    uint32_t stamp;         // 0 for an empty entry
+    int32_t det_num;
+    struct YoloV5Box boxes[CACHE_ENTRY_BOXES];
+};
+
+// detections by content hash of the encoded image, in a set associative
+// table of CACHE_WAYS entries per bucket. the table lives in an anonymous
+// mapping, or in a shared mapping of an index file to keep it across runs
+struct result_cache {
+    struct cache_header* header;
+    struct cache_entry* entries;
+    size_t map_size;
+    int hits;
+    int misses;
+};
+
+// path may be NULL for a cache of this process only. an index file made
+// for other settings, another size or another layout is cleared
+bool result_cache_open(struct result_cache* cache, const char* path, int entry_num, uint64_t config){
+    memset(cache, 0, sizeof(*cache));
+    uint32_t bucket_num = (entry_num + CACHE_WAYS - 1) / CACHE_WAYS;
+    size_t map_size = sizeof(struct cache_header) + (size_t)bucket_num * CACHE_WAYS * sizeof(struct cache_entry);
+    void* p;
+    if (path == NULL){
+        p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0){
+            perror("Error opening the cache index");
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size != map_size){
+            if (ftruncate(fd, 0) != 0 || ftruncate(fd, map_size) != 0){
+                perror("Error sizing the cache index");
+                close(fd);
+                return false;
+            }
+        }
+        p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (p == MAP_FAILED){
+        perror("Error mapping the cache");
+        return false;
+    }
+
+    cache->header = (struct cache_header*)p;
+    cache->entries = (struct cache_entry*)(cache->header + 1);
+    cache->map_size = map_size;
+    struct cache_header* h = cache->header;
+    if (h->magic != CACHE_MAGIC || h->version != CACHE_VERSION || h->entry_size != sizeof(struct cache_entry)
+            || h->config != config || h->bucket_num != bucket_num){
+        memset(cache->entries, 0, map_size - sizeof(struct cache_header));
+        h->magic = CACHE_MAGIC;
+        h->version = CACHE_VERSION;
+        h->entry_size = sizeof(struct cache_entry);
+        h->config = config;
+        h->bucket_num = bucket_num;
+        h->stamp = 0;
+    }
+    return true;
+}
+
+void result_cache_close(struct result_cache* cache){
+    if (cache->header != NULL)
+        munmap(cache->header, cache->map_size);
+}
+
+struct cache_entry* result_cache_bucket(struct result_cache* cache, uint64_t hash){
+    return cache->entries + (hash % cache->header->bucket_num) * CACHE_WAYS;
+}
+
+// copy the boxes of a file seen before into boxes, room for
+// CACHE_ENTRY_BOXES. returns false on a miss, and for an entry whose box
+// count is out of range, as the index may have been damaged on disk
+bool result_cache_get(struct result_cache* cache, uint64_t hash, size_t size,
+        struct YoloV5Box* boxes, int* det_num){
+    struct cache_entry* bucket = result_cache_bucket(cache, hash);
+    for (int w=0;w<CACHE_WAYS;w++){
+        struct cache_entry* e = &bucket[w];
+        if (e->stamp == 0 || e->hash != hash || e->size != size) continue;
+        if (e->det_num < 0 || e->det_num > CACHE_ENTRY_BOXES) continue;
+        e->stamp = ++cache->header->stamp;
+        memcpy(boxes, e->boxes, e->det_num * sizeof(struct YoloV5Box));
+        *det_num = e->det_num;
+        cache->hits++;
+        return true;
+    }
+    cache->misses++;
+    return false;
+}
+
+// store the boxes of a file, in place of the least recently used entry
+// of its bucket
+void result_cache_put(struct result_cache* cache, uint64_t hash, size_t size,
+        const struct YoloV5Box* boxes, int det_num){
+    if (det_num > CACHE_ENTRY_BOXES) return;
+    struct cache_entry* bucket = result_cache_bucket(cache, hash);
+    struct cache_entry* e = &bucket[0];
+    for (int w=0;w<CACHE_WAYS;w++){
+        if (bucket[w].stamp != 0 && bucket[w].hash == hash && bucket[w].size == size){
+            e = &bucket[w];
+            break;
+        }
+        if (bucket[w].stamp < e->stamp) e = &bucket[w];
+    }
+    e->hash = hash;
+    e->size = size;
+    e->det_num = det_num;
+    memcpy(e->boxes, boxes, det_num * sizeof(struct YoloV5Box));
+    e->stamp = ++cache->header->stamp;
+}
+#endif
@@ -0,0 +1,167 @@
+#ifndef CASCADE_H
+#define CASCADE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "yolov5.h"
+#include "yuv.h"
+#include "net.h"
+
+// second stage classifier, with the crop scratch of its batch slots
+struct cascade {
+    struct bm_net net;
+    unsigned char* resized;     // net_w x net_h rgb of every slot
+    struct yuv_tap* taps;       // 2 * net_w taps of every slot
+    float* rows;                // 3 * net_w floats of every slot
+};
+
+// load the classifier of path. the crops are written as float rgb / 255
+// with no mean or std, so any other input exits
+void cascade_init(struct cascade* c, bm_handle_t handle, void* p_bmrt, const char* path, bool is_soc, bool is_1688){
+    bm_net_init(&c->net, handle, p_bmrt, bm_net_load(p_bmrt, path), is_soc, is_1688);
+    const bm_shape_t* shape = &c->net.input.shape;
+    if (c->net.input.dtype != BM_FLOAT32 || shape->num_dims != 4 || shape->dims[1] != 3){
+        printf("the classifier %s needs a 3 channel float32 input\n", c->net.name);
+        exit(1);
+    }
+    int net_w = shape->dims[3], net_h = shape->dims[2];
+    c->resized = (unsigned char*)malloc((size_t)c->net.batch * net_w * net_h * 3);
+    c->taps = (struct yuv_tap*)malloc((size_t)c->net.batch * 2 * net_w * sizeof(struct yuv_tap));
+    c->rows = (float*)malloc((size_t)c->net.batch * 3 * net_w * sizeof(float));
+}
+
+void cascade_free(struct cascade* c){
+    free(c->rows);
+    free(c->taps);
+    free(c->resized);
+    bm_net_free(&c->net);
+}
+
+// crops of one batch of boxes, from an rgb image or a yuv frame
+struct cascade_job {
+    const struct YoloV5Box* boxes;
+    const unsigned char* img;   // NULL for a yuv frame
+    const struct yuv_frame* frame;
+    int width;
+    int height;
+    float* input_data;
+    size_t item_size;   // floats of one batch item
+    int net_w;
+    int net_h;
+    unsigned char* resized;
+    struct yuv_tap* taps;
+    float* rows;
+};
+
+// the box clipped to whole pixels of the image, false if nothing is left
+bool cascade_crop(const struct YoloV5Box* box, int width, int height, bool even,
+        int* x0, int* y0, int* w, int* h){
+    int x1 = (int)floorf(box->x), y1 = (int)floorf(box->y);
+    int x2 = (int)ceilf(box->x + box->w), y2 = (int)ceilf(box->y + box->h);
+    if (even){
+        x1 &= ~1;
+        y1 &= ~1;
+    }
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > width) x2 = width;
+    if (y2 > height) y2 = height;
+    if (x2 - x1 < 2 || y2 - y1 < 2) return false;
+    *x0 = x1;
+    *y0 = y1;
+    *w = x2 - x1;
+    *h = y2 - y1;
+    return true;
+}
+
+// stretch the crop of box i into batch item i, read in place from the image
+void cascade_task(void* arg, int i){
+    struct cascade_job* job = (struct cascade_job*)arg;
+    float* input_data = job->input_data + i * job->item_size;
+    int x, y, w, h;
+    if (!cascade_crop(&job->boxes[i], job->width, job->height, job->img == NULL, &x, &y, &w, &h))
+        return;
+    struct resize_info r = {w, h, job->net_w, job->net_h,
+            (float)job->net_w / w, (float)job->net_h / h, 0, 0, false, x, y};
+
+    if (job->img != NULL){
+        int stride = job->width * 3;
+        unsigned char* resized_img = job->resized + (size_t)i * job->net_w * job->net_h * 3;
+        stbir_resize_uint8_linear(job->img + (size_t)y * stride + x * 3, w, h, stride,
+                resized_img, job->net_w, job->net_h, 0, STBIR_RGB);
+        hwc_to_chw(resized_img, job->net_w * 3, job->net_w, 0, job->net_h, input_data, &r);
+    } else {
+        // one band of the yuv path over taps of this crop
+        struct yuv_frame crop;
+        yuv_frame_crop(&crop, job->frame, x, y, w, h);
+        struct resize_plan plan;
+        memset(&plan, 0, sizeof(plan));
+        plan.target_w = job->net_w;
+        plan.target_h = job->net_h;
+        plan.taps = job->taps + (size_t)i * 2 * job->net_w;
+        plan.rows = job->rows + (size_t)i * 3 * job->net_w;
+        plan.row_bands = 1;
+        float scale_x = (float)w / job->net_w;
+        yuv_build_taps(plan.taps, job->net_w, w, scale_x, 1);
+        yuv_build_taps(plan.taps + job->net_w, job->net_w, (w+1)/2, scale_x / 2, crop.uv_step);
+        struct yuv_job yjob = {&crop, &plan, input_data, &r, 1};
+        pre_process_yuv_band(&yjob, 0);
+    }
+}
+
+// value c of a classifier output, dequantized
+float cascade_value(const struct yolov5_output* out, int c){
+    if (out->dtype == BM_INT8)
+        return ((const signed char*)out->data)[c] * out->scale;
+    if (out->dtype == BM_FLOAT16)
+        return half_to_float(((const unsigned short*)out->data)[c]);
+    return ((const float*)out->data)[c];
+}
+
+// classify the crops of det_num boxes, a batch of crops per launch, the
+// crops of a batch are resized in parallel on pool. returns det_num
+// results to free
+struct cascade_result* cascade_run(struct cascade* c, struct thread_pool* pool,
+        const struct YoloV5Box* boxes, int det_num,
+        const unsigned char* img, const struct yuv_frame* frame, int width, int height){
+    struct bm_net* net = &c->net;
+    struct cascade_result* results = (struct cascade_result*)malloc((det_num + 1) * sizeof(struct cascade_result));
+    const bm_shape_t* shape = &net->input.shape;
+    const bm_shape_t* out_shape = &net->outputs[0].shape;
+    int class_num = bmrt_shape_count(out_shape) / net->batch;
+    struct cascade_job job = {NULL, img, frame, width, height, net->input_data,
+            bm_net_input_count(net), shape->dims[3], shape->dims[2], c->resized, c->taps, c->rows};
+
+    for (int first=0;first<det_num;first+=net->batch){
+        int num = det_num - first < net->batch ? det_num - first : net->batch;
+        job.boxes = boxes + first;
+        thread_pool_run(pool, cascade_task, &job, num);
+        bm_net_upload(net);
+        bm_net_forward(net);
+
+        for (int b=0;b<num;b++){
+            struct cascade_result* res = &results[first + b];
+            int x, y, w, h;
+            if (!cascade_crop(&boxes[first + b], width, height, img == NULL, &x, &y, &w, &h)){
+                res->class_id = -1;
+                res->score = 0;
+                continue;
+            }
+            struct yolov5_output outputs[BM_NET_MAX_OUTPUTS];
+            bm_net_yolov5_outputs(net, b, outputs);
+            res->class_id = 0;
+            res->score = cascade_value(&outputs[0], 0);
+            for (int c=1;c<class_num;c++){
+                float v = cascade_value(&outputs[0], c);
+                if (v > res->score){
+                    res->class_id = c;
+                    res->score = v;
+                }
+            }
+        }
+        bm_net_release_outputs(net);
+    }
+    return results;
+}
+#endif
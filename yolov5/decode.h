@@ -0,0 +1,468 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <bmruntime_interface.h>
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "model.h"
+#include "nms.h"
+
+// one raw output head as it comes from the device, int8 and fp16 heads
+// are only dequantized for the anchors that pass the objectness check
+struct yolov5_output {
+    const void* data;
+    bm_data_type_t dtype;
+    float scale;
+};
+
+// allow-list of classes, the channels of other classes are never read
+struct class_subset {
+    int num;            // 0 for all classes
+    int* ids;           // ascending
+    float* thresh;      // score threshold of each listed class
+    float min_thresh;
+};
+
+// post-process settings
+struct yolov5_params {
+    float conf_thresh;
+    float nms_thresh;
+    struct class_subset classes;
+    bool multi_label;   // one candidate per passing class instead of the best class only
+    int max_candidates; // best candidates that go into NMS, 0 for all
+    int max_det;        // best detections kept after NMS, 0 for all
+    enum nms_mode nms_mode;
+    bool parallel_decode;   // bands of head rows on the pool
+    bool parallel_nms;  // classes of NMS on the pool
+    struct thread_pool* pool;   // workers of the parallel steps, NULL for serial
+};
+
+void yolov5_params_init(struct yolov5_params* params){
+    memset(params, 0, sizeof(*params));
+    params->conf_thresh = 0.5;
+    params->nms_thresh = 0.6;
+}
+
+void yolov5_params_free(struct yolov5_params* params){
+    free(params->classes.ids);
+    free(params->classes.thresh);
+    memset(&params->classes, 0, sizeof(params->classes));
+}
+
+// candidates of a decode, multi-label lists grow with the passing classes
+struct box_list {
+    struct YoloV5Box* boxes;
+    int num;
+    int cap;
+};
+
+// room for n more boxes
+void box_list_reserve(struct box_list* list, int n){
+    if (list->num + n <= list->cap) return;
+    list->cap = (list->num + n) * 2;
+    list->boxes = (struct YoloV5Box*)realloc(list->boxes, list->cap * sizeof(struct YoloV5Box));
+}
+
+// raw domain view of one output head
+struct yolov5_raw_head {
+    const void* data;
+    bm_data_type_t dtype;
+    int obj_key;            // raw objectness must be above this to be decoded
+    float lut[256];         // sigmoid of every int8 value
+};
+
+void raw_head_init(struct yolov5_raw_head* head, const struct yolov5_output* out, float conf_thresh){
+    head->data = out->data;
+    head->dtype = out->dtype;
+    float t = logit(conf_thresh) - 1e-3f;
+    if (out->dtype == BM_INT8){
+        head->obj_key = (int)floorf(t / out->scale);
+        if (head->obj_key < -129) head->obj_key = -129;
+        if (head->obj_key > 127) head->obj_key = 127;
+        for (int q=-128;q<128;q++){
+            head->lut[q+128] = sigmoid(q * out->scale);
+        }
+    } else if (out->dtype == BM_FLOAT16){
+        head->obj_key = half_key(float_to_half(t));
+        if (half_to_float(half_from_key(head->obj_key)) > t) head->obj_key--;
+    } else {
+        assert(out->dtype == BM_FLOAT32);
+    }
+}
+
+// cheap objectness check on the raw value, conservative
+bool raw_obj_pass(const struct yolov5_raw_head* head, size_t idx, float float_thresh){
+    switch (head->dtype){
+    case BM_INT8:
+        return ((const signed char*)head->data)[idx] > head->obj_key;
+    case BM_FLOAT16:
+        return half_key(((const unsigned short*)head->data)[idx]) > head->obj_key;
+    default:
+        return ((const float*)head->data)[idx] > float_thresh;
+    }
+}
+
+// sigmoid of n raw values starting at idx
+void raw_sigmoid(const struct yolov5_raw_head* head, size_t idx, float* dst, int n){
+    if (head->dtype == BM_INT8){
+        const signed char* p = (const signed char*)head->data + idx;
+        for (int d=0;d<n;d++) dst[d] = head->lut[p[d]+128];
+    } else if (head->dtype == BM_FLOAT16){
+        const unsigned short* p = (const unsigned short*)head->data + idx;
+        for (int d=0;d<n;d++) dst[d] = sigmoid(half_to_float(p[d]));
+    } else {
+        const float* p = (const float*)head->data + idx;
+        for (int d=0;d<n;d++) dst[d] = sigmoid(p[d]);
+    }
+}
+
+// box of one anchor in network input pixels, ptr holds the sigmoid outputs
+static inline __attribute__((always_inline))
+void decode_box(const float* ptr, int gx, int gy, int feat_w, int feat_h, float anchor_w, float anchor_h,
+        int net_w, int net_h, struct YoloV5Box* box){
+    float x = (ptr[0] * 2 - 0.5 + gx) / feat_w * net_w;
+    float y = (ptr[1] * 2 - 0.5 + gy) / feat_h * net_h;
+    float w = pow((ptr[2] * 2), 2) * anchor_w;
+    float h = pow((ptr[3] * 2), 2) * anchor_h;
+    box->x = x - w / 2;
+    box->y = y - h / 2;
+    box->w = w;
+    box->h = h;
+}
+
+// decode rows [gy_begin, gy_end) of one anchor plane of a head into boxes,
+// idx is the first value of row gy_begin. returns the number of boxes.
+// always inlined, so a caller passing constant sizes gets the class loop
+// unrolled and no per-cell divisions. with a class subset only the box,
+// the objectness and the listed class channels are read
+static inline __attribute__((always_inline))
+int decode_plane(const struct yolov5_raw_head* head, size_t idx, int feat_w, int feat_h,
+        int gy_begin, int gy_end, int nout, int class_num, float anchor_w, float anchor_h, int net_w, int net_h,
+        float conf_thresh, const struct class_subset* subset, float obj_logit, float* ptr,
+        struct YoloV5Box* boxes){
+    int box_i = 0;
+    for (int gy = gy_begin; gy < gy_end; gy++){
+        for (int gx = 0; gx < feat_w; gx++, idx += nout){
+            // reject on the raw objectness before anything is dequantized
+            if (!raw_obj_pass(head, idx + 4, obj_logit)) continue;
+
+            unsigned class_id = 0;
+            float score, confidence, thresh;
+            if (subset != NULL){
+                raw_sigmoid(head, idx, ptr, 5);
+                score = ptr[4];
+                if (score <= subset->min_thresh) continue;
+                // the best listed class among those over their own threshold
+                int best = -1;
+                confidence = 0;
+                for (int k=0;k<subset->num;k++){
+                    float c;
+                    raw_sigmoid(head, idx + 5 + subset->ids[k], &c, 1);
+                    if (c * score > subset->thresh[k] && c > confidence){
+                        confidence = c;
+                        best = k;
+                    }
+                }
+                if (best < 0) continue;
+                class_id = subset->ids[best];
+                thresh = subset->thresh[best];
+            } else {
+                raw_sigmoid(head, idx, ptr, nout);
+                score = ptr[4];
+                if (score <= conf_thresh) continue;
+
+                confidence = ptr[5];
+#if defined(__ARM_NEON)
+                argmax_neon(&ptr[5], class_num, &confidence, &class_id);
+#elif defined(__SSE4_1__)
+                argmax_sse(&ptr[5], class_num, &confidence, &class_id);
+#else
+                argmax(&ptr[5], class_num, &confidence, &class_id);
+#endif
+                thresh = conf_thresh;
+            }
+            float final_score = confidence * score;
+            if (final_score > thresh) {
+                struct YoloV5Box* box = &boxes[box_i];
+                decode_box(ptr, gx, gy, feat_w, feat_h, anchor_w, anchor_h, net_w, net_h, box);
+                box->class_id = class_id;
+                box->score    = final_score;
+
+                box_i ++;
+            }
+        }
+    }
+    return box_i;
+}
+
+// multi-label version of decode_plane, an anchor gives one candidate for
+// every class whose score passes, appended to out. the geometry is decoded
+// once per anchor, but every candidate carries its own copy of it, as the
+// NMS backends take whole boxes and lay them out again for their kernels
+int decode_plane_multi(const struct yolov5_raw_head* head, size_t idx, int feat_w, int feat_h,
+        int gy_begin, int gy_end, int nout, int class_num, float anchor_w, float anchor_h, int net_w, int net_h,
+        float conf_thresh, const struct class_subset* subset, float obj_logit, float* ptr,
+        unsigned* index, struct box_list* out){
+    int first = out->num;
+    for (int gy = gy_begin; gy < gy_end; gy++){
+        for (int gx = 0; gx < feat_w; gx++, idx += nout){
+            if (!raw_obj_pass(head, idx + 4, obj_logit)) continue;
+
+            int n = 0;
+            float score;
+            if (subset != NULL){
+                raw_sigmoid(head, idx, ptr, 5);
+                score = ptr[4];
+                if (score <= subset->min_thresh) continue;
+                for (int k=0;k<subset->num;k++){
+                    int c = subset->ids[k];
+                    raw_sigmoid(head, idx + 5 + c, &ptr[5 + c], 1);
+                    if (ptr[5 + c] * score > subset->thresh[k]) index[n++] = c;
+                }
+            } else {
+                raw_sigmoid(head, idx, ptr, nout);
+                score = ptr[4];
+                if (score <= conf_thresh) continue;
+                // cls > thresh / obj, checked again on the product below
+#if defined(__ARM_NEON)
+                n = compress_gt_neon(&ptr[5], class_num, conf_thresh / score, index);
+#elif defined(__SSE4_1__)
+                n = compress_gt_sse(&ptr[5], class_num, conf_thresh / score, index);
+#else
+                n = compress_gt(&ptr[5], class_num, conf_thresh / score, index);
+#endif
+            }
+            if (n == 0) continue;
+
+            struct YoloV5Box box;
+            decode_box(ptr, gx, gy, feat_w, feat_h, anchor_w, anchor_h, net_w, net_h, &box);
+            box_list_reserve(out, n);
+            for (int k=0;k<n;k++){
+                float final_score = ptr[5 + index[k]] * score;
+                if (subset == NULL && final_score <= conf_thresh) continue;
+                box.class_id = index[k];
+                box.score = final_score;
+                out->boxes[out->num++] = box;
+            }
+        }
+    }
+    return out->num - first;
+}
+
+// objectness threshold the raw heads are built for
+float decode_obj_thresh(const struct yolov5_params* params){
+    return params->classes.num > 0 ? params->classes.min_thresh : params->conf_thresh;
+}
+
+// rows [gy_begin, gy_end) of one anchor plane with the generic kernels,
+// appended to out. ptr holds nout floats, index class_num
+int decode_rows(const struct yolov5_raw_head* head, const struct yolov5_model* model,
+        const struct yolov5_params* params, int tidx, int anchor_idx, int gy_begin, int gy_end,
+        float* ptr, unsigned* index, struct box_list* out){
+    const struct yolov5_head* yolo_head = &model->heads[tidx];
+    const struct class_subset* subset = params->classes.num > 0 ? &params->classes : NULL;
+    float conf_thresh = decode_obj_thresh(params);
+    float obj_logit = logit(conf_thresh) - 1e-3f;
+    size_t idx = ((size_t)anchor_idx * yolo_head->feat_h + gy_begin) * yolo_head->feat_w * model->nout;
+    if (params->multi_label){
+        return decode_plane_multi(head, idx, yolo_head->feat_w, yolo_head->feat_h, gy_begin, gy_end,
+                model->nout, model->class_num, yolo_head->anchors[anchor_idx][0], yolo_head->anchors[anchor_idx][1],
+                model->net_w, model->net_h, conf_thresh, subset, obj_logit, ptr, index, out);
+    }
+    box_list_reserve(out, (gy_end - gy_begin) * yolo_head->feat_w);
+    int n = decode_plane(head, idx, yolo_head->feat_w, yolo_head->feat_h, gy_begin, gy_end,
+            model->nout, model->class_num, yolo_head->anchors[anchor_idx][0], yolo_head->anchors[anchor_idx][1],
+            model->net_w, model->net_h, conf_thresh, subset, obj_logit, ptr, out->boxes + out->num);
+    out->num += n;
+    return n;
+}
+
+// decoder for any head geometry, class subsets and multi-label, the
+// candidates are appended to out
+int decode_generic(const struct yolov5_output* output, const struct yolov5_model* model,
+        const struct yolov5_params* params, struct box_list* out){
+    float* ptr = (float*)malloc(model->nout * sizeof(float));
+    unsigned* index = params->multi_label ? (unsigned*)malloc(model->class_num * sizeof(unsigned)) : NULL;
+    for (int tidx = 0; tidx < model->head_num; ++tidx) {
+        const struct yolov5_head* yolo_head = &model->heads[tidx];
+        struct yolov5_raw_head head;
+        raw_head_init(&head, &output[yolo_head->output_idx], decode_obj_thresh(params));
+        for (int anchor_idx = 0; anchor_idx < model->anchor_num; anchor_idx++) {
+            decode_rows(&head, model, params, tidx, anchor_idx, 0, yolo_head->feat_h, ptr, index, out);
+        }
+    }
+    free(index);
+    free(ptr);
+    return out->num;
+}
+
+// a band of rows of one anchor plane, a task of the parallel decode
+struct decode_slice {
+    int head;
+    int anchor;
+    int gy_begin;
+    int gy_end;
+    struct box_list list;
+};
+
+struct decode_job {
+    const struct yolov5_model* model;
+    const struct yolov5_params* params;
+    const struct yolov5_raw_head* heads;
+    struct decode_slice* slices;
+};
+
+void decode_slice_task(void* arg, int i){
+    struct decode_job* job = (struct decode_job*)arg;
+    struct decode_slice* slice = &job->slices[i];
+    const struct yolov5_model* model = job->model;
+    float* ptr = (float*)malloc(model->nout * sizeof(float));
+    unsigned* index = job->params->multi_label ? (unsigned*)malloc(model->class_num * sizeof(unsigned)) : NULL;
+    decode_rows(&job->heads[slice->head], model, job->params, slice->head, slice->anchor,
+            slice->gy_begin, slice->gy_end, ptr, index, &slice->list);
+    free(index);
+    free(ptr);
+}
+
+// decode_generic with bands of rows spread over params->pool. every band
+// has its own output, they are joined in the serial order, so the boxes
+// are the same as from decode_generic. single-label bands write straight
+// into their share of out, multi-label bands into their own lists
+int decode_parallel(const struct yolov5_output* output, const struct yolov5_model* model,
+        const struct yolov5_params* params, struct box_list* out){
+    struct yolov5_raw_head heads[YOLOV5_MAX_HEADS];
+    for (int t=0;t<model->head_num;t++){
+        raw_head_init(&heads[t], &output[model->heads[t].output_idx], decode_obj_thresh(params));
+    }
+
+    // a few bands per thread, so a band full of objects does not hold up the rest
+    int band_cells = model->box_num / (4 * thread_pool_size(params->pool));
+    if (band_cells < 256) band_cells = 256;
+    int slice_num = 0;
+    for (int t=0;t<model->head_num;t++){
+        int rows = (band_cells + model->heads[t].feat_w - 1) / model->heads[t].feat_w;
+        slice_num += model->anchor_num * ((model->heads[t].feat_h + rows - 1) / rows);
+    }
+    struct decode_slice* slices = (struct decode_slice*)malloc(slice_num * sizeof(struct decode_slice));
+    if (!params->multi_label)
+        box_list_reserve(out, model->box_num);
+    int s = 0, cell = 0;
+    for (int t=0;t<model->head_num;t++){
+        const struct yolov5_head* head = &model->heads[t];
+        int rows = (band_cells + head->feat_w - 1) / head->feat_w;
+        for (int a=0;a<model->anchor_num;a++){
+            for (int gy=0;gy<head->feat_h;gy+=rows, s++){
+                struct decode_slice* slice = &slices[s];
+                slice->head = t;
+                slice->anchor = a;
+                slice->gy_begin = gy;
+                slice->gy_end = gy + rows < head->feat_h ? gy + rows : head->feat_h;
+                int cells = (slice->gy_end - gy) * head->feat_w;
+                if (params->multi_label){
+                    slice->list.boxes = (struct YoloV5Box*)malloc(cells * sizeof(struct YoloV5Box));
+                } else {
+                    slice->list.boxes = out->boxes + out->num + cell;
+                }
+                slice->list.num = 0;
+                slice->list.cap = cells;
+                cell += cells;
+            }
+        }
+    }
+
+    struct decode_job job = {model, params, heads, slices};
+    thread_pool_run(params->pool, decode_slice_task, &job, slice_num);
+
+    // bands come after each other, so the moves only go down
+    int first = out->num;
+    for (s=0;s<slice_num;s++){
+        struct box_list* list = &slices[s].list;
+        if (params->multi_label){
+            box_list_reserve(out, list->num);
+            memcpy(out->boxes + out->num, list->boxes, list->num * sizeof(struct YoloV5Box));
+            free(list->boxes);
+        } else {
+            memmove(out->boxes + out->num, list->boxes, list->num * sizeof(struct YoloV5Box));
+        }
+        out->num += list->num;
+    }
+    free(slices);
+    return out->num - first;
+}
+
+// one head of a specialized decoder, everything but the data is a constant
+#define YOLOV5_DECODE_HEAD(T, NET_W, NET_H, STRIDE, CLASS_NUM, ANCHORS) { \
+    struct yolov5_raw_head head; \
+    raw_head_init(&head, &output[model->heads[T].output_idx], conf_thresh); \
+    for (int anchor_idx = 0; anchor_idx < 3; anchor_idx++) { \
+        box_i += decode_plane(&head, \
+                (size_t)anchor_idx * ((NET_W)/(STRIDE)) * ((NET_H)/(STRIDE)) * (5+(CLASS_NUM)), \
+                (NET_W)/(STRIDE), (NET_H)/(STRIDE), 0, (NET_H)/(STRIDE), 5+(CLASS_NUM), (CLASS_NUM), \
+                ANCHORS[T][anchor_idx][0], ANCHORS[T][anchor_idx][1], (NET_W), (NET_H), \
+                conf_thresh, NULL, obj_logit, ptr, boxes + box_i); \
+    } \
+}
+
+// decoder for a fixed 3 head geometry with strides 8/16/32, all classes
+#define YOLOV5_DECODER(NAME, NET_W, NET_H, CLASS_NUM, ANCHORS) \
+int NAME(const struct yolov5_output* output, const struct yolov5_model* model, \
+        const struct yolov5_params* params, struct YoloV5Box* boxes){ \
+    float conf_thresh = params->conf_thresh; \
+    float obj_logit = logit(conf_thresh) - 1e-3f; \
+    float ptr[5+(CLASS_NUM)]; \
+    int box_i = 0; \
+    YOLOV5_DECODE_HEAD(0, NET_W, NET_H, 8, CLASS_NUM, ANCHORS) \
+    YOLOV5_DECODE_HEAD(1, NET_W, NET_H, 16, CLASS_NUM, ANCHORS) \
+    YOLOV5_DECODE_HEAD(2, NET_W, NET_H, 32, CLASS_NUM, ANCHORS) \
+    return box_i; \
+}
+
+// the geometries we ship, add a line here and one in DECODERS for a new one
+YOLOV5_DECODER(decode_640_c80, 640, 640, 80, DEFAULT_ANCHORS_P5)
+YOLOV5_DECODER(decode_320_c3, 320, 320, 3, DEFAULT_ANCHORS_P5)
+
+struct yolov5_decoder {
+    const char* name;
+    int net_w;
+    int net_h;
+    int class_num;
+    const float (*anchors)[3][2];
+    yolov5_decode_fn decode;
+};
+
+const struct yolov5_decoder DECODERS[] = {
+    {"640x640, 80 classes", 640, 640, 80, DEFAULT_ANCHORS_P5, decode_640_c80},
+    {"320x320, 3 classes", 320, 320, 3, DEFAULT_ANCHORS_P5, decode_320_c3},
+};
+
+bool yolov5_decoder_match(const struct yolov5_decoder* d, const struct yolov5_model* model){
+    if (model->net_w != d->net_w || model->net_h != d->net_h || model->class_num != d->class_num
+            || model->head_num != 3 || model->anchor_num != 3)
+        return false;
+    for (int t=0;t<3;t++){
+        const struct yolov5_head* head = &model->heads[t];
+        if (head->feat_w != d->net_w / (8 << t) || head->feat_h != d->net_h / (8 << t))
+            return false;
+        for (int a=0;a<3;a++){
+            if (head->anchors[a][0] != d->anchors[t][a][0] || head->anchors[a][1] != d->anchors[t][a][1])
+                return false;
+        }
+    }
+    return true;
+}
+
+// pick the specialized decoder of this geometry, or leave the generic one
+const char* yolov5_select_decoder(struct yolov5_model* model){
+    model->decode = NULL;
+    for (size_t i=0;i<sizeof(DECODERS)/sizeof(DECODERS[0]);i++){
+        if (yolov5_decoder_match(&DECODERS[i], model)){
+            model->decode = DECODERS[i].decode;
+            return DECODERS[i].name;
+        }
+    }
+    return "generic";
+}
+#endif
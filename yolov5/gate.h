@@ -0,0 +1,155 @@
+#ifndef GATE_H
+#define GATE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+#define GATE_BLOCK          8       // luma is averaged over GATE_BLOCK x GATE_BLOCK blocks
+#define GATE_PIX_THRESH     10      // block mean change counted as motion
+#define GATE_MIN_CHANGED    0.001f  // share of blocks that may change without being motion
+
+// mean luma of every full block of a luma plane
+void gate_blocks_y(const unsigned char* y, int stride, int width, int height, unsigned char* blocks){
+    int bw = width / GATE_BLOCK, bh = height / GATE_BLOCK;
+    for (int by=0;by<bh;by++){
+        const unsigned char* rows = y + by * GATE_BLOCK * stride;
+        unsigned char* out = blocks + by * bw;
+        int bx = 0;
+#ifdef __SSE4_1__
+        // sad against zero sums the 8 bytes of two blocks per row
+        __m128i zero = _mm_setzero_si128();
+        for (; bx + 2 <= bw; bx += 2){
+            __m128i acc = zero;
+            for (int i=0;i<GATE_BLOCK;i++){
+                __m128i v = _mm_loadu_si128((const __m128i*)(rows + i * stride + bx * GATE_BLOCK));
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+            }
+            out[bx] = _mm_cvtsi128_si32(acc) / (GATE_BLOCK * GATE_BLOCK);
+            out[bx+1] = _mm_extract_epi32(acc, 2) / (GATE_BLOCK * GATE_BLOCK);
+        }
+#elif defined(__ARM_NEON)
+        for (; bx + 2 <= bw; bx += 2){
+            uint16x8_t acc = vdupq_n_u16(0);
+            for (int i=0;i<GATE_BLOCK;i++)
+                acc = vpadalq_u8(acc, vld1q_u8(rows + i * stride + bx * GATE_BLOCK));
+            uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(acc));
+            out[bx] = vgetq_lane_u64(sum, 0) / (GATE_BLOCK * GATE_BLOCK);
+            out[bx+1] = vgetq_lane_u64(sum, 1) / (GATE_BLOCK * GATE_BLOCK);
+        }
+#endif
+        for (; bx<bw; bx++){
+            unsigned sum = 0;
+            for (int i=0;i<GATE_BLOCK;i++){
+                const unsigned char* p = rows + i * stride + bx * GATE_BLOCK;
+                for (int j=0;j<GATE_BLOCK;j++) sum += p[j];
+            }
+            out[bx] = sum / (GATE_BLOCK * GATE_BLOCK);
+        }
+    }
+}
+
+// mean luma of every full block of an rgb image
+void gate_blocks_rgb(const unsigned char* img, int width, int height, unsigned char* blocks){
+    int bw = width / GATE_BLOCK, bh = height / GATE_BLOCK;
+    unsigned* sums = (unsigned*)malloc((bw + 1) * sizeof(unsigned));
+    for (int by=0;by<bh;by++){
+        memset(sums, 0, bw * sizeof(unsigned));
+        for (int i=0;i<GATE_BLOCK;i++){
+            const unsigned char* p = img + ((size_t)(by * GATE_BLOCK + i) * width) * 3;
+            for (int x=0;x<bw*GATE_BLOCK;x++, p+=3)
+                sums[x / GATE_BLOCK] += (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;
+        }
+        for (int bx=0;bx<bw;bx++) blocks[by * bw + bx] = sums[bx] / (GATE_BLOCK * GATE_BLOCK);
+    }
+    free(sums);
+}
+
+// number of blocks whose mean changed by more than thresh
+int gate_changed(const unsigned char* a, const unsigned char* b, int num, int thresh){
+    int n = 0, i = 0;
+#ifdef __SSE4_1__
+    __m128i t = _mm_set1_epi8((char)thresh), zero = _mm_setzero_si128();
+    for (; i + 16 <= num; i += 16){
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        int same = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(diff, t), zero));
+        n += __builtin_popcount(~same & 0xffff);
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t t = vdupq_n_u8(thresh);
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 16 <= num; i += 16){
+        uint8x16_t gt = vcgtq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)), t);
+        acc = vpadalq_u16(acc, vpaddlq_u8(vshrq_n_u8(gt, 7)));
+    }
+    uint64x2_t sum = vpaddlq_u32(acc);
+    n = vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+#endif
+    for (; i<num; i++){
+        if (abs(a[i] - b[i]) > thresh) n++;
+    }
+    return n;
+}
+
+// skips inference on frames that barely differ from the last frame that
+// was run, the reference. comparing with the reference instead of the
+// previous frame lets slow changes add up
+struct motion_gate {
+    int width;
+    int height;
+    int block_num;
+    unsigned char* ref;     // block means of the reference
+    unsigned char* cur;
+    bool valid;
+    int pix_thresh;
+    int refresh;            // frames after which inference runs anyway
+    int since;              // frames since the reference
+    int skipped;
+    int frames;
+};
+
+void motion_gate_init(struct motion_gate* gate, int refresh, int pix_thresh){
+    memset(gate, 0, sizeof(*gate));
+    gate->refresh = refresh;
+    gate->pix_thresh = pix_thresh;
+}
+
+void motion_gate_free(struct motion_gate* gate){
+    free(gate->ref);
+    free(gate->cur);
+}
+
+// block means of the current frame must be in gate->cur. returns whether
+// the frame has to be run, which makes it the reference
+bool motion_gate_check(struct motion_gate* gate){
+    gate->frames++;
+    if (gate->valid && ++gate->since < gate->refresh){
+        int changed = gate_changed(gate->ref, gate->cur, gate->block_num, gate->pix_thresh);
+        if (changed <= (int)(gate->block_num * GATE_MIN_CHANGED)){
+            gate->skipped++;
+            return false;
+        }
+    }
+    unsigned char* t = gate->ref;
+    gate->ref = gate->cur;
+    gate->cur = t;
+    gate->valid = true;
+    gate->since = 0;
+    return true;
+}
+
+// size the block buffers for a frame, a new size drops the reference
+unsigned char* motion_gate_blocks(struct motion_gate* gate, int width, int height){
+    if (width != gate->width || height != gate->height){
+        gate->width = width;
+        gate->height = height;
+        gate->block_num = (width / GATE_BLOCK) * (height / GATE_BLOCK);
+        gate->ref = (unsigned char*)realloc(gate->ref, gate->block_num + 1);
+        gate->cur = (unsigned char*)realloc(gate->cur, gate->block_num + 1);
+        gate->valid = false;
+    }
+    return gate->cur;
+}
+#endif
@@ -2,10 +2,248 @@
 #define STBI_NEON
 #endif
 
+#include <unistd.h>
 #include <bmruntime_interface.h>
 #include "yolov5.h"
+#include "tile.h"
+#include "mosaic.h"
+#include "adapt.h"
+#include "tracker.h"
+#include "gate.h"
+#include "cache.h"
+#include "roi.h"
+#include "cascade.h"
+
+void usage(const char* prog){
+    printf("Usage: %s [options] [img ...]\n", prog);
+    printf("       %s -f nv12|i420 -s WxH [options] file.yuv\n", prog);
+    printf("  -f fmt    read raw yuv420 frames (nv12 or i420) instead of images\n");
+    printf("  -s WxH    frame size of the yuv file\n");
+    printf("  -t num    threads used by preprocess, -D and -P, default 1\n");
+    printf("  -p value  letterbox pad value in pixel units, default 0 (yolov5 uses 114)\n");
+    printf("  -b file   bmodel to load, may be repeated to run several detectors on\n");
+    printf("            every frame in one runtime, sharing the resized input\n");
+    printf("  -m file   model cfg with anchors and class names\n");
+    printf("  -c list   only detect these classes, e.g. person:0.4,car,truck\n");
+    printf("  -l        multi-label, keep every class above the threshold for an anchor\n");
+    printf("  -k num    keep the num best candidates before NMS, default all\n");
+    printf("  -n num    keep the num best detections after NMS, default all\n");
+    printf("  -N mode   NMS backend: pairwise (default), bitmask, grid, diou,\n");
+    printf("            soft-linear or soft-gaussian\n");
+    printf("  -D        decode bands of the output heads in parallel\n");
+    printf("  -P        run NMS of different classes in parallel\n");
+    printf("  -T px     cut images larger than the net into net sized tiles overlapping\n");
+    printf("            by px pixels, batched through the net, boxes merged by NMS\n");
+    printf("  -W        merge the boxes of tiles by weighted box fusion instead\n");
+    printf("  -M num    pack the images num x num into each input, for thumbnails\n");
+    printf("  -S stage  stage of a multi-stage bmodel: an index, or auto[:pixels] (default)\n");
+    printf("            for the stage padding each image the least, at most pixels large\n");
+    printf("  -A fps    adapt the stage to the load of a source of fps frames per second,\n");
+    printf("            smaller stages while frames back up, larger ones once caught up\n");
+    printf("  -K num    track objects and detect only every num frames, or earlier when\n");
+    printf("            the position of a track gets too uncertain to match it\n");
+    printf("  -G n[:d]  reuse the last boxes while the mean luma of no 8x8 block moved by\n");
+    printf("            more than d (default 10) since the last run frame, run every n frames\n");
+    printf("  -C num    cache the boxes of up to num images by a hash of the file bytes,\n");
+    printf("            identical files are reported without decode or inference\n");
+    printf("  -I file   keep the cache in an index file across runs\n");
+    printf("  -R roi    only run the region x,y,WxH of every frame, at the resolution\n");
+    printf("            of the net, boxes are in frame coordinates. may be repeated\n");
+    printf("  -X file   classify the crop of every detection with a second bmodel,\n");
+    printf("            a batch of crops per launch. it needs a float32 input, the crops\n");
+    printf("            are only scaled to [0, 1] with no mean or std\n");
+}
 
 int main(int argc, char** argv){
+    // parse options
+    bool yuv_mode = false;
+    enum yuv_format yuv_fmt = YUV_NV12;
+    int yuv_w = 0, yuv_h = 0;
+    int threads = 1;
+    int pad_value = 0;
+    const char* bmodel_paths[BM_MAX_BMODELS] = {"yolov5s_v6.1_3output_int8_1b.bmodel"};
+    int bmodel_num = 0;
+    const char* cfg_path = NULL;
+    const char* class_list = NULL;
+    bool multi_label = false;
+    int max_candidates = 0;
+    int max_det = 0;
+    enum nms_mode nms_mode = NMS_PAIRWISE;
+    bool parallel_decode = false;
+    bool parallel_nms = false;
+    int tile_overlap = -1;
+    bool tile_wbf = false;
+    int mosaic = 0;
+    int stage_opt = -1;
+    int stage_max_area = 0;
+    float adapt_fps = 0;
+    int track_interval = 0;
+    int gate_refresh = 0;
+    int gate_thresh = GATE_PIX_THRESH;
+    int cache_entries = 0;
+    const char* cache_path = NULL;
+    struct roi* rois = NULL;
+    int roi_num = 0;
+    const char* cascade_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:s:t:p:b:m:c:lk:n:N:DPT:WM:S:A:K:G:C:I:R:X:h")) != -1){
+        switch (opt){
+        case 'f':
+            yuv_mode = true;
+            if (strcmp(optarg, "nv12") == 0){
+                yuv_fmt = YUV_NV12;
+            } else if (strcmp(optarg, "i420") == 0){
+                yuv_fmt = YUV_I420;
+            } else {
+                printf("unknown yuv format: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &yuv_w, &yuv_h) != 2){
+                printf("bad frame size: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            threads = atoi(optarg);
+            if (threads < 1) threads = 1;
+            break;
+        case 'p':
+            pad_value = atoi(optarg);
+            break;
+        case 'b':
+            if (bmodel_num == BM_MAX_BMODELS){
+                printf("at most %d bmodels\n", BM_MAX_BMODELS);
+                exit(1);
+            }
+            bmodel_paths[bmodel_num++] = optarg;
+            break;
+        case 'm':
+            cfg_path = optarg;
+            break;
+        case 'c':
+            class_list = optarg;
+            break;
+        case 'l':
+            multi_label = true;
+            break;
+        case 'k':
+            max_candidates = atoi(optarg);
+            break;
+        case 'n':
+            max_det = atoi(optarg);
+            break;
+        case 'N':
+            if (!nms_mode_parse(optarg, &nms_mode)){
+                printf("unknown NMS mode: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'D':
+            parallel_decode = true;
+            break;
+        case 'P':
+            parallel_nms = true;
+            break;
+        case 'T':
+            tile_overlap = atoi(optarg);
+            if (tile_overlap < 0){
+                printf("bad tile overlap: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'W':
+            tile_wbf = true;
+            break;
+        case 'M':
+            mosaic = atoi(optarg);
+            if (mosaic < 2){
+                printf("bad mosaic grid: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            if (strncmp(optarg, "auto", 4) == 0){
+                stage_opt = -1;
+                if (optarg[4] == ':') stage_max_area = atoi(optarg + 5);
+            } else {
+                stage_opt = atoi(optarg);
+            }
+            break;
+        case 'A':
+            adapt_fps = atof(optarg);
+            if (adapt_fps <= 0){
+                printf("bad frame rate: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'K':
+            track_interval = atoi(optarg);
+            if (track_interval < 1){
+                printf("bad keyframe interval: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'G':
+            if (sscanf(optarg, "%d:%d", &gate_refresh, &gate_thresh) < 1 || gate_refresh < 1
+                    || gate_thresh < 0 || gate_thresh > 255){
+                printf("bad gate: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'C':
+            cache_entries = atoi(optarg);
+            if (cache_entries < 1){
+                printf("bad cache size: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'I':
+            cache_path = optarg;
+            break;
+        case 'R':
+            if (!roi_parse(optarg, &rois, &roi_num)){
+                printf("bad region of interest: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'X':
+            cascade_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+
+    if (cache_entries > 0 && (track_interval > 0 || gate_refresh > 0 || adapt_fps > 0)){
+        printf("-C caches images on their own, it does not go with -K, -G or -A\n");
+        exit(1);
+    }
+    if (roi_num > 0 && (tile_overlap >= 0 || mosaic > 0)){
+        printf("-R does not go with -T or -M\n");
+        exit(1);
+    }
+    if (bmodel_num == 0)
+        bmodel_num = 1;
+    if (bmodel_num > 1 && (tile_overlap >= 0 || mosaic > 0 || track_interval > 0 || gate_refresh > 0
+            || cache_entries > 0)){
+        printf("several -b do not go with -T, -M, -K, -G or -C\n");
+        exit(1);
+    }
+    if (cascade_path != NULL && (cache_entries > 0 || mosaic > 0)){
+        printf("-X crops the decoded image, it does not go with -C or -M\n");
+        exit(1);
+    }
+    // tracked boxes between keyframes would be classified again every frame
+    if (cascade_path != NULL && track_interval > 0){
+        printf("-X does not go with -K\n");
+        exit(1);
+    }
+    if (cache_path != NULL && cache_entries == 0)
+        cache_entries = 1024;
+
     // request bm_handle
     bm_handle_t bm_handle;
     bm_status_t status;
@@ -59,146 +297,423 @@ int main(int argc, char** argv){
     void *p_bmrt = bmrt_create(bm_handle);
     assert(NULL != p_bmrt);
 
-    // load bmodel by file
-    bool ret = bmrt_load_bmodel(p_bmrt, "yolov5s_v6.1_3output_int8_1b.bmodel");
-    assert(true == ret);
+    // load the bmodels into one runtime, each network with its own tensors
+    int net_num = bmodel_num;
+    struct bm_net* nets = (struct bm_net*)malloc(net_num * sizeof(struct bm_net));
+    for (int d=0;d<net_num;d++)
+        bm_net_init(&nets[d], bm_handle, p_bmrt, bm_net_load(p_bmrt, bmodel_paths[d]), is_soc, is_1688);
+    struct bm_net* net = &nets[0];
+    const bm_net_info_t* net_info = net->info;
+    if (adapt_fps > 0 && net_info->stage_num < 2){
+        printf("-A switches between the stages of a bmodel, %s has only one\n", net->name);
+        exit(1);
+    }
 
-    // get net_info
-    const char** net_names = NULL;
-    bmrt_get_network_names(p_bmrt, &net_names);
-    const bm_net_info_t* net_info = bmrt_get_network_info(p_bmrt, net_names[0]);
-    assert(NULL != net_info);
+    // second stage classifier in the same runtime
+    struct cascade cascade;
+    if (cascade_path != NULL){
+        cascade_init(&cascade, bm_handle, p_bmrt, cascade_path, is_soc, is_1688);
+        const bm_shape_t* shape = &cascade.net.input.shape;
+        printf("cascade: %s, %dx%d, batch %d\n", cascade.net.name, shape->dims[3], shape->dims[2], cascade.net.batch);
+    }
 
-    // get img path
-    const char* img_path;
-    if (argc > 1){
-        img_path = argv[1];
-    } else {
-        img_path = "../datasets/dog.jpg";
+    // head geometry comes from the output shapes, anchors and names may come from a cfg
+    struct yolov5_model_cfg model_cfg;
+    memset(&model_cfg, 0, sizeof(model_cfg));
+    if (cfg_path != NULL && !yolov5_model_cfg_load(&model_cfg, cfg_path))
+        exit(1);
+    // the cfg describes the first bmodel, the others use the coco defaults
+    struct yolov5_model** net_models = (struct yolov5_model**)malloc(net_num * sizeof(struct yolov5_model*));
+    for (int d=0;d<net_num;d++){
+        const bm_net_info_t* info = nets[d].info;
+        if (stage_opt >= info->stage_num){
+            printf("bad stage %d, the bmodel has %d\n", stage_opt, info->stage_num);
+            exit(1);
+        }
+        if (net_num > 1)
+            printf("net %d: %s\n", d, nets[d].name);
+        net_models[d] = (struct yolov5_model*)malloc(info->stage_num * sizeof(struct yolov5_model));
+        for (int s=0;s<info->stage_num;s++){
+            struct yolov5_model* m = &net_models[d][s];
+            if (!yolov5_model_init(m, info, s, cfg_path != NULL && d == 0 ? &model_cfg : NULL))
+                exit(1);
+            if (info->stage_num == 1)
+                printf("post-process decoder: %s\n", yolov5_select_decoder(m));
+            else
+                printf("stage %d: %dx%d, post-process decoder: %s\n", s, m->net_w, m->net_h,
+                        yolov5_select_decoder(m));
+        }
     }
+    struct yolov5_model* models = net_models[0];
+    // tiles and mosaics use one stage for all images
+    int fixed_stage = stage_opt >= 0 ? stage_opt : 0;
 
-    // read image
-    int width, height, channels;
-    unsigned char *img = stbi_load(img_path, &width, &height, &channels, 0);
-    if (img == NULL) {
-            printf("Error in loading the image\n");
+    // thresholds and the class allow-list
+    struct yolov5_params params;
+    yolov5_params_init(&params);
+    params.multi_label = multi_label;
+    params.max_candidates = max_candidates;
+    params.max_det = max_det;
+    params.nms_mode = nms_mode;
+    params.parallel_decode = parallel_decode;
+    params.parallel_nms = parallel_nms;
+    struct yolov5_params* net_params = (struct yolov5_params*)malloc(net_num * sizeof(struct yolov5_params));
+    for (int d=0;d<net_num;d++){
+        net_params[d] = params;
+        if (class_list != NULL && !class_subset_parse(&net_params[d], &net_models[d][0], class_list))
             exit(1);
     }
-    printf("img: %s, width = %d, height = %d, channels = %d\n", img_path, width, height, channels);
-
-    struct resize_info r_info;
-    r_info.ori_w = width;
-    r_info.ori_h = height;
-    r_info.net_w = net_info->stages[0].input_shapes->dims[3];
-    r_info.net_h = net_info->stages[0].input_shapes->dims[2];
-    r_info.ratio_x = (float)r_info.net_w/r_info.ori_w;
-    r_info.ratio_y = (float)r_info.net_h/r_info.ori_h;
-    r_info.start_x = 0;
-    r_info.start_y = 0;
-    r_info.keep_aspect = true;
-
-    // prepare input tensor and output tensor
-    bm_tensor_t input_tensors[1];
-    for (int i=0;i<net_info->input_num;i++){
-        input_tensors[i].dtype = net_info->input_dtypes[i];
-        if (is_1688)
-            bm_malloc_device_byte(bm_handle, &input_tensors[i].device_mem, net_info->max_input_bytes[i]);
-        else
-            input_tensors[i].device_mem = net_info->stages[0].input_mems[i];
-        input_tensors[i].shape = net_info->stages[0].input_shapes[i];
-        input_tensors[i].st_mode = BM_STORE_1N;
-    }
-
-    bm_tensor_t output_tensors[3];
-    for (int i=0;i<net_info->output_num;i++){
-        output_tensors[i].dtype = net_info->output_dtypes[i];
-        output_tensors[i].shape = net_info->stages[0].output_shapes[i];
-        if (is_1688)
-            bm_malloc_device_byte(bm_handle, &output_tensors[i].device_mem, net_info->max_output_bytes[i]);
-        else
-            output_tensors[i].device_mem = net_info->stages[0].output_mems[i];
-        output_tensors[i].st_mode = BM_STORE_1N;
-    }
-
-    // prepare input data memory
-    float* input_data[1];
-    if(is_soc){
-        status = bm_mem_mmap_device_mem(bm_handle, &input_tensors[0].device_mem,
-                (long long unsigned int*)&input_data[0]);
-        assert(BM_SUCCESS == status);
-    } else {
-        input_data[0] = (float*)calloc(channels*r_info.net_w*r_info.net_h,sizeof(float));
+    if (tile_overlap >= models[fixed_stage].net_w || tile_overlap >= models[fixed_stage].net_h){
+        printf("tile overlap must be smaller than the net\n");
+        exit(1);
     }
 
-    // do preprocess and fill input_data
-    pre_process(img, input_data[0], &r_info);
-
-    // flush the cache or s2d
-    if(is_soc){
-        status = bm_mem_flush_device_mem(bm_handle, &input_tensors[0].device_mem);
-    } else {
-        status = bm_memcpy_s2d_partial(bm_handle, input_tensors[0].device_mem,
-                (long long unsigned int*)input_data[0], bmrt_tensor_bytesize(&input_tensors[0]));
-        free(input_data[0]);
+    // open yuv file, frames are read one by one
+    FILE* yuv_file = NULL;
+    unsigned char* yuv_buf = NULL;
+    size_t yuv_bytes = 0;
+    if (yuv_mode){
+        const char* yuv_path = optind < argc ? argv[optind] : NULL;
+        if (yuv_path == NULL || yuv_w <= 0 || yuv_h <= 0){
+            printf("yuv input needs a file and -s WxH\n");
+            exit(1);
+        }
+        yuv_file = fopen(yuv_path, "rb");
+        if (yuv_file == NULL){
+            printf("Error in opening %s\n", yuv_path);
+            exit(1);
+        }
+        yuv_bytes = yuv_frame_size(yuv_w, yuv_h);
+        yuv_buf = (unsigned char*)malloc(yuv_bytes);
     }
-    assert(BM_SUCCESS == status);
 
-    // do inference
-    ret = bmrt_launch_tensor_ex(p_bmrt, net_names[0], input_tensors, 1, output_tensors, 3, true, false);
-    assert(true == ret);
+    // letterbox geometry and resize samplers, reused while the resolution is unchanged
+    struct thread_pool* pool = thread_pool_create(threads);
+    for (int d=0;d<net_num;d++)
+        net_params[d].pool = pool;
+    struct resize_plan_cache plan_cache;
+    resize_plan_cache_init(&plan_cache, threads, pad_value);
 
-    // sync, wait for finishing inference
-    bm_thread_sync(bm_handle);
+    // stage following the load, from the largest one
+    struct adapt_ctl adapt;
+    if (adapt_fps > 0)
+        adapt_ctl_init(&adapt, net_info, adapt_fps);
 
-    if (is_soc){
-        status = bm_mem_unmap_device_mem(bm_handle, input_data[0], bm_mem_get_device_size(input_tensors[0].device_mem));
-        assert(BM_SUCCESS == status);
+    // boxes carried between keyframes, uncertain tracks need a detection
+    struct tracker tracker;
+    if (track_interval > 0)
+        tracker_init(&tracker, track_interval);
+
+    // static scenes reuse the boxes of the last frame that was run
+    struct motion_gate gate;
+    struct YoloV5Box* last_boxes = NULL;
+    int last_num = 0;
+    if (gate_refresh > 0)
+        motion_gate_init(&gate, gate_refresh, gate_thresh);
+
+    // boxes of files seen before, valid for the bmodel and the options they came from
+    struct result_cache cache;
+    if (cache_entries > 0){
+        struct stat st, cfg_st;
+        memset(&st, 0, sizeof(st));
+        memset(&cfg_st, 0, sizeof(cfg_st));
+        stat(bmodel_paths[0], &st);
+        if (cfg_path != NULL)
+            stat(cfg_path, &cfg_st);
+        char config[1024];
+        int len = snprintf(config, sizeof(config), "%s %lld %lld %s %lld %lld %s %d %d %d %d %d %d %d %d",
+                bmodel_paths[0], (long long)st.st_size, (long long)st.st_mtime,
+                cfg_path ? cfg_path : "", (long long)cfg_st.st_size, (long long)cfg_st.st_mtime,
+                class_list ? class_list : "", pad_value, multi_label, max_candidates, max_det,
+                nms_mode, tile_overlap, tile_wbf, stage_opt >= 0 ? stage_opt : -1 - stage_max_area);
+        for (int v=0;v<roi_num && len < (int)sizeof(config);v++)
+            len += snprintf(config + len, sizeof(config) - len, " %d,%d,%dx%d",
+                    rois[v].x, rois[v].y, rois[v].w, rois[v].h);
+        if (len > (int)sizeof(config)) len = sizeof(config);
+        if (!result_cache_open(&cache, cache_path, cache_entries, xxh64(config, len, 0)))
+            exit(1);
     }
 
-    // prepare output data
-    float* output[3];
-    if (is_soc){
-        for (int i=0;i<3;i++){
-            status = bm_mem_mmap_device_mem(bm_handle, &output_tensors[i].device_mem,
-                    (long long unsigned int*)&output[i]);
-            assert(BM_SUCCESS == status);
-            status = bm_mem_invalidate_device_mem(bm_handle, &output_tensors[i].device_mem);
-            assert(BM_SUCCESS == status);
+    // images packed into mosaics take all the inputs at once
+    int arg_i = optind;
+    if (mosaic > 0 && !yuv_mode && arg_i < argc){
+        bm_net_set_stage(net, fixed_stage);
+        mosaic_run(net, &models[fixed_stage], &net_params[0], argv + arg_i, argc - arg_i, mosaic, plan_cache.pad.value);
+        arg_i = argc;
+    }
+    for (int frame_id = 0; ; frame_id++){
+        // get next img path or yuv frame
+        const char* img_path = NULL;
+        unsigned char* img = NULL;
+        struct yuv_frame frame;
+        int width, height, channels = 3;
+        size_t file_size = 0;
+        uint64_t file_hash = 0;
+        if (yuv_mode){
+            if (fread(yuv_buf, 1, yuv_bytes, yuv_file) != yuv_bytes)
+                break;
+            yuv_frame_init(&frame, yuv_buf, yuv_w, yuv_h, yuv_fmt);
+            width = yuv_w;
+            height = yuv_h;
+            printf("frame: %d, width = %d, height = %d\n", frame_id, width, height);
+        } else {
+            if (arg_i < argc){
+                img_path = argv[arg_i++];
+            } else if (frame_id == 0 && optind == argc){
+                img_path = "../datasets/dog.jpg";
+            } else {
+                break;
+            }
+
+            // identical files were detected before, decode the mapped bytes otherwise
+            if (cache_entries > 0){
+                const unsigned char* file_data = file_map(img_path, &file_size);
+                if (file_data == NULL){
+                    printf("Error in loading the image\n");
+                    exit(1);
+                }
+                file_hash = xxh64(file_data, file_size, 0);
+                struct YoloV5Box cached[CACHE_ENTRY_BOXES];
+                int cached_num;
+                if (result_cache_get(&cache, file_hash, file_size, cached, &cached_num)){
+                    file_unmap(file_data, file_size);
+                    printf("img: %s, cached\n", img_path);
+                    yolov5_report(&models[0], cached, cached_num, img_path, NULL, 0, 0);
+                    continue;
+                }
+                img = stbi_load_from_memory(file_data, file_size, &width, &height, &channels, 0);
+                file_unmap(file_data, file_size);
+            } else {
+                img = stbi_load(img_path, &width, &height, &channels, 0);
+            }
+            if (img == NULL) {
+                    printf("Error in loading the image\n");
+                    exit(1);
+            }
+            printf("img: %s, width = %d, height = %d, channels = %d\n", img_path, width, height, channels);
         }
-    } else {
-        for (int i=0;i<3;i++){
-            output[i] = (float*)malloc(net_info->max_output_bytes[i]);
-            bm_memcpy_d2s_partial(bm_handle, output[i], output_tensors[i].device_mem, bmrt_tensor_bytesize(&output_tensors[i]));
+
+        // skip frames that barely changed, before any preprocessing
+        if (gate_refresh > 0){
+            unsigned char* blocks = motion_gate_blocks(&gate, width, height);
+            if (yuv_mode)
+                gate_blocks_y(frame.y, frame.stride_y, width, height, blocks);
+            else
+                gate_blocks_rgb(img, width, height, blocks);
+            if (!motion_gate_check(&gate)){
+                printf("static frame\n");
+                yolov5_report(&models[0], last_boxes, last_num, img_path, img, width, height);
+                if (img != NULL)
+                    stbi_image_free(img);
+                if (adapt_fps > 0)
+                    adapt_ctl_update(&adapt);
+                continue;
+            }
         }
-    }
 
-    // do postprocess
-    post_process(output, img_path, img, &r_info);
+        // between keyframes the tracker predicts the boxes, with no inference
+        bool keyframe = track_interval == 0 || tracker_need_detect(&tracker);
+        if (track_interval > 0)
+            tracker_predict(&tracker);
 
-    stbi_image_free(img);
+        // boxes of every network, those of the first one go through the tracker and the caches
+        int net_det_num[BM_MAX_BMODELS] = {0};
+        struct YoloV5Box* net_boxes[BM_MAX_BMODELS] = {NULL};
+        struct yolov5_model* model = &models[fixed_stage];
+        if (!keyframe){
+            printf("tracked frame\n");
+        } else if (tile_overlap >= 0 && img != NULL && (width > model->net_w || height > model->net_h)){
+            // high resolution images are cut into tiles, each batch of them one launch
+            bm_net_set_stage(net, fixed_stage);
+            net_boxes[0] = detect_tiled(net, model, &net_params[0], img, width, height,
+                    tile_overlap, plan_cache.pad.value, tile_wbf, &net_det_num[0]);
+            // the tiles overwrote the letterbox border
+            plan_cache.pad.buf = NULL;
+        } else {
+            // the regions of interest one by one with no copy, or the whole frame
+            int view_num = roi_num > 0 ? roi_num : 1;
+            for (int v=0;v<view_num;v++){
+                struct roi view = {0, 0, width, height};
+                if (roi_num > 0 && !roi_clip(&rois[v], width, height, yuv_mode, &view))
+                    continue;
+                if (roi_num > 0)
+                    printf("roi: %d,%d,%dx%d\n", view.x, view.y, view.w, view.h);
 
-    if (is_soc){
-        for (int i=0;i<3;i++){
-            status = bm_mem_unmap_device_mem(bm_handle, output[i], bm_mem_get_device_size(output_tensors[i].device_mem));
-            assert(BM_SUCCESS == status);
+                struct resize_info r_infos[BM_MAX_BMODELS];
+                for (int d=0;d<net_num;d++){
+                    struct bm_net* dnet = &nets[d];
+
+                    // the stage of the load, the one asked for, or the one padding this view the least
+                    int stage;
+                    if (adapt_fps > 0 && d == 0)
+                        stage = adapt_stage(&adapt);
+                    else if (stage_opt >= 0)
+                        stage = stage_opt;
+                    else
+                        stage = bm_net_pick_stage(dnet, view.w, view.h, stage_max_area);
+                    // a new input buffer needs its border written and uploaded again
+                    if (bm_net_set_stage(dnet, stage))
+                        plan_cache.pad.buf = NULL;
+                    struct yolov5_model* dmodel = &net_models[d][stage];
+                    if (d == 0)
+                        model = dmodel;
+                    if (dnet->info->stage_num > 1)
+                        printf("stage: %d, %dx%d\n", stage, dmodel->net_w, dmodel->net_h);
+
+                    // a network of the same input shape and type already has this view resized
+                    int src = -1;
+                    for (int e=0;e<d && src < 0;e++){
+                        if (bm_net_same_input(&nets[e], dnet))
+                            src = e;
+                    }
+                    struct resize_info* r_info = &r_infos[d];
+                    if (src >= 0){
+                        *r_info = r_infos[src];
+                        memcpy(dnet->input_data, nets[src].input_data, bm_net_input_count(dnet) * sizeof(float));
+                        bm_net_upload(dnet);
+                    } else {
+                        r_info->ori_w = view.w;
+                        r_info->ori_h = view.h;
+                        r_info->net_w = dmodel->net_w;
+                        r_info->net_h = dmodel->net_h;
+                        r_info->ratio_x = (float)r_info->net_w/r_info->ori_w;
+                        r_info->ratio_y = (float)r_info->net_h/r_info->ori_h;
+                        r_info->start_x = 0;
+                        r_info->start_y = 0;
+                        r_info->keep_aspect = true;
+                        r_info->view_x = view.x;
+                        r_info->view_y = view.y;
+
+                        // do preprocess and fill input_data
+                        if (yuv_mode){
+                            struct yuv_frame crop;
+                            yuv_frame_crop(&crop, &frame, view.x, view.y, view.w, view.h);
+                            pre_process_yuv(&crop, dnet->input_data, r_info, &plan_cache, pool);
+                        } else {
+                            int stride = width * 3;
+                            pre_process(img + (size_t)view.y * stride + view.x * 3, stride,
+                                    dnet->input_data, r_info, &plan_cache, pool);
+                        }
+
+                        // flush the cache or s2d, only the active rows once the border is on device
+                        struct letterbox_pad* pad = &plan_cache.pad;
+                        if (pad->dirty){
+                            bm_net_upload(dnet);
+                            pad->dirty = false;
+                        } else {
+                            bm_net_upload_rows(dnet, pad->start_y, pad->start_y + pad->target_h);
+                        }
+                    }
+
+                    // do inference
+                    bm_net_forward(dnet);
+                    struct yolov5_output outputs[YOLOV5_MAX_HEADS];
+                    bm_net_yolov5_outputs(dnet, 0, outputs);
+
+                    // do postprocess, boxes come back in frame coordinates
+                    int view_det_num;
+                    struct YoloV5Box* view_boxes = yolov5_detect(outputs, dmodel, &net_params[d], r_info, &view_det_num);
+                    bm_net_release_outputs(dnet);
+                    if (view_num == 1){
+                        net_boxes[d] = view_boxes;
+                        net_det_num[d] = view_det_num;
+                    } else {
+                        net_boxes[d] = (struct YoloV5Box*)realloc(net_boxes[d],
+                                (net_det_num[d] + view_det_num + 1) * sizeof(struct YoloV5Box));
+                        memcpy(net_boxes[d] + net_det_num[d], view_boxes, view_det_num * sizeof(struct YoloV5Box));
+                        net_det_num[d] += view_det_num;
+                        free(view_boxes);
+                    }
+                }
+            }
+            // overlapping regions see the same objects
+            if (view_num > 1){
+                for (int d=0;d<net_num;d++)
+                    net_det_num[d] = tile_merge(&net_params[d], net_boxes[d], net_det_num[d], tile_wbf);
+            }
         }
-    } else {
-        for (int i=0;i<3;i++){
-            free(output[i]);
+
+        // report the tracks, corrected by the detections on keyframes
+        int det_num = net_det_num[0];
+        struct YoloV5Box* boxes = net_boxes[0];
+        if (track_interval > 0){
+            if (keyframe)
+                tracker_update(&tracker, boxes, det_num);
+            boxes = (struct YoloV5Box*)realloc(boxes, (tracker.num + 1) * sizeof(struct YoloV5Box));
+            det_num = tracker_boxes(&tracker, boxes, width, height);
+            net_boxes[0] = boxes;
+            net_det_num[0] = det_num;
         }
-    }
 
-    // at last, free device memory
-    if (is_1688){
-        for (int i = 0; i < net_info->input_num; ++i) {
-            bm_free_device(bm_handle, input_tensors[i].device_mem);
+        // crops are taken before the boxes are drawn into img
+        struct cascade_result* classes[BM_MAX_BMODELS] = {NULL};
+        if (cascade_path != NULL){
+            for (int d=0;d<net_num;d++)
+                classes[d] = cascade_run(&cascade, pool, net_boxes[d], net_det_num[d], img, &frame, width, height);
+        }
+        for (int d=0;d<net_num;d++){
+            if (net_num > 1)
+                printf("net: %s\n", nets[d].name);
+            yolov5_draw(d == 0 ? model : &net_models[d][0], net_boxes[d], net_det_num[d], classes[d], img, width, height);
+            free(classes[d]);
         }
-        for (int i = 0; i < net_info->output_num; ++i) {
-            bm_free_device(bm_handle, output_tensors[i].device_mem);
+        if (img != NULL)
+            yolov5_save(img_path, img, width, height);
+        if (cache_entries > 0 && img != NULL)
+            result_cache_put(&cache, file_hash, file_size, boxes, det_num);
+        if (gate_refresh > 0){
+            last_boxes = (struct YoloV5Box*)realloc(last_boxes, (det_num + 1) * sizeof(struct YoloV5Box));
+            memcpy(last_boxes, boxes, det_num * sizeof(struct YoloV5Box));
+            last_num = det_num;
         }
+        for (int d=0;d<net_num;d++)
+            free(net_boxes[d]);
+
+        if (img != NULL)
+            stbi_image_free(img);
+        if (adapt_fps > 0)
+            adapt_ctl_update(&adapt);
+    }
+
+    if (gate_refresh > 0){
+        printf("gate: %d frames, %d skipped\n", gate.frames, gate.skipped);
+        motion_gate_free(&gate);
+        free(last_boxes);
+    }
+    if (track_interval > 0){
+        printf("tracker: %d frames, %d keyframes\n", tracker.frames, tracker.keyframes);
+        tracker_free(&tracker);
+    }
+    if (cache_entries > 0){
+        printf("cache: %d hits, %d misses\n", cache.hits, cache.misses);
+        result_cache_close(&cache);
+    }
+    if (adapt_fps > 0){
+        adapt_ctl_report(&adapt);
+        adapt_ctl_free(&adapt);
+    }
+
+    free(rois);
+    resize_plan_cache_free(&plan_cache);
+    for (int d=0;d<net_num;d++)
+        yolov5_params_free(&net_params[d]);
+    free(net_params);
+    yolov5_model_cfg_free(&model_cfg);
+    for (int d=0;d<net_num;d++)
+        free(net_models[d]);
+    free(net_models);
+    thread_pool_destroy(pool);
+
+    if (yuv_mode){
+        free(yuv_buf);
+        fclose(yuv_file);
     }
 
-    free(net_names);
+    if (cascade_path != NULL)
+        cascade_free(&cascade);
+    for (int d=0;d<net_num;d++)
+        bm_net_free(&nets[d]);
+    free(nets);
     bmrt_destroy(p_bmrt);
     bm_dev_free(bm_handle);
 
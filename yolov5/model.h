@@ -0,0 +1,218 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <bmruntime_interface.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define YOLOV5_MAX_HEADS 4
+#define YOLOV5_MAX_ANCHORS 3
+
+// default anchors from yolov5, finest grid first
+const float DEFAULT_ANCHORS_P5[3][3][2] = {
+    {{10, 13}, {16, 30}, {33, 23}},
+    {{30, 61}, {62, 45}, {59, 119}},
+    {{116, 90}, {156, 198}, {373, 326}}};
+const float DEFAULT_ANCHORS_P6[4][3][2] = {
+    {{19, 27}, {44, 40}, {38, 94}},
+    {{96, 68}, {86, 152}, {180, 137}},
+    {{140, 301}, {303, 264}, {238, 542}},
+    {{436, 615}, {739, 380}, {925, 792}}};
+
+struct yolov5_output;
+struct yolov5_model;
+struct yolov5_params;
+struct YoloV5Box;
+
+// decode all heads into boxes above the thresholds, returns the number of boxes
+typedef int (*yolov5_decode_fn)(const struct yolov5_output* output, const struct yolov5_model* model,
+        const struct yolov5_params* params, struct YoloV5Box* boxes);
+
+// one detection head, shape is [1, anchor_num, feat_h, feat_w, nout]
+struct yolov5_head {
+    int output_idx;     // which network output holds this head
+    int feat_w;
+    int feat_h;
+    float anchors[YOLOV5_MAX_ANCHORS][2];
+};
+
+// head geometry of a bmodel stage, heads are sorted from the finest grid
+struct yolov5_model {
+    int net_w;
+    int net_h;
+    int head_num;
+    int anchor_num;
+    int nout;
+    int class_num;
+    int box_num;
+    struct yolov5_head heads[YOLOV5_MAX_HEADS];
+    char** class_names;     // from the sidecar config, NULL for the built-in names
+    int class_names_num;
+    yolov5_decode_fn decode;    // specialized decoder, NULL for the generic one
+};
+
+// sidecar config of a model, every key is optional
+//   # anchors of one head in pixels, one line per head from the finest grid
+//   anchors = 10,13, 16,30, 33,23
+//   # class names, comma separated
+//   names = person, bicycle, car
+struct yolov5_model_cfg {
+    int anchor_lines;
+    int anchor_counts[YOLOV5_MAX_HEADS];
+    float anchors[YOLOV5_MAX_HEADS][YOLOV5_MAX_ANCHORS][2];
+    char** names;
+    int names_num;
+};
+
+char* trim(char* s){
+    while (isspace((unsigned char)*s)) s++;
+    char* end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+bool yolov5_model_cfg_load(struct yolov5_model_cfg* cfg, const char* path){
+    memset(cfg, 0, sizeof(*cfg));
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL){
+        printf("%s does not exist!\n", path);
+        return false;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)){
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char* eq = strchr(line, '=');
+        if (eq == NULL) continue;
+        *eq = '\0';
+        char* key = trim(line);
+        char* value = eq + 1;
+        if (strcmp(key, "anchors") == 0){
+            if (cfg->anchor_lines == YOLOV5_MAX_HEADS){
+                printf("%s: too many anchor lines\n", path);
+                fclose(fp);
+                return false;
+            }
+            int n = 0;
+            float* dst = &cfg->anchors[cfg->anchor_lines][0][0];
+            char* end;
+            for (char* p = value; ; p = end){
+                while (*p == ',' || isspace((unsigned char)*p)) p++;
+                if (*p == '\0') break;
+                float v = strtof(p, &end);
+                if (end == p || n == 2*YOLOV5_MAX_ANCHORS){
+                    printf("%s: bad anchors line\n", path);
+                    fclose(fp);
+                    return false;
+                }
+                dst[n++] = v;
+            }
+            cfg->anchor_counts[cfg->anchor_lines++] = n/2;
+        } else if (strcmp(key, "names") == 0){
+            for (char* tok = strtok(value, ","); tok; tok = strtok(NULL, ",")){
+                cfg->names = (char**)realloc(cfg->names, (cfg->names_num+1) * sizeof(char*));
+                cfg->names[cfg->names_num++] = strdup(trim(tok));
+            }
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// sort heads from the finest grid, the usual anchor order
+void yolov5_sort_heads(struct yolov5_model* model){
+    for (int i=1;i<model->head_num;i++){
+        struct yolov5_head h = model->heads[i];
+        int j = i - 1;
+        while (j >= 0 && model->heads[j].feat_w < h.feat_w){
+            model->heads[j+1] = model->heads[j];
+            j--;
+        }
+        model->heads[j+1] = h;
+    }
+}
+
+// derive the head geometry from the output shapes of one stage,
+// cfg may be NULL to use the default anchors and names
+bool yolov5_model_init(struct yolov5_model* model, const bm_net_info_t* net_info, int stage,
+        const struct yolov5_model_cfg* cfg){
+    memset(model, 0, sizeof(*model));
+    const bm_stage_info_t* st = &net_info->stages[stage];
+    model->net_w = st->input_shapes[0].dims[3];
+    model->net_h = st->input_shapes[0].dims[2];
+    if (net_info->output_num > YOLOV5_MAX_HEADS){
+        printf("%d outputs, at most %d heads are supported\n", net_info->output_num, YOLOV5_MAX_HEADS);
+        return false;
+    }
+    model->head_num = net_info->output_num;
+    for (int i=0;i<model->head_num;i++){
+        const bm_shape_t* shape = &st->output_shapes[i];
+        if (shape->num_dims != 5){
+            printf("output %d should be [n, anchors, h, w, 5+classes]\n", i);
+            return false;
+        }
+        if (i == 0){
+            model->anchor_num = shape->dims[1];
+            model->nout = shape->dims[4];
+        } else if (shape->dims[1] != model->anchor_num || shape->dims[4] != model->nout){
+            printf("output %d does not match output 0\n", i);
+            return false;
+        }
+        model->heads[i].output_idx = i;
+        model->heads[i].feat_h = shape->dims[2];
+        model->heads[i].feat_w = shape->dims[3];
+        model->box_num += model->anchor_num * shape->dims[2] * shape->dims[3];
+    }
+    model->class_num = model->nout - 5;
+    if (model->anchor_num > YOLOV5_MAX_ANCHORS || model->class_num < 1){
+        printf("unsupported head: %d anchors, %d outputs per anchor\n", model->anchor_num, model->nout);
+        return false;
+    }
+    yolov5_sort_heads(model);
+
+    // anchors from the cfg, or the yolov5 defaults for 3 or 4 heads
+    for (int i=0;i<model->head_num;i++){
+        struct yolov5_head* head = &model->heads[i];
+        for (int a=0;a<model->anchor_num;a++){
+            if (cfg != NULL && cfg->anchor_lines > 0){
+                if (cfg->anchor_lines != model->head_num || cfg->anchor_counts[i] != model->anchor_num){
+                    printf("cfg anchors do not match %d heads x %d anchors\n", model->head_num, model->anchor_num);
+                    return false;
+                }
+                head->anchors[a][0] = cfg->anchors[i][a][0];
+                head->anchors[a][1] = cfg->anchors[i][a][1];
+            } else if (model->head_num == 3 && model->anchor_num == 3){
+                head->anchors[a][0] = DEFAULT_ANCHORS_P5[i][a][0];
+                head->anchors[a][1] = DEFAULT_ANCHORS_P5[i][a][1];
+            } else if (model->head_num == 4 && model->anchor_num == 3){
+                head->anchors[a][0] = DEFAULT_ANCHORS_P6[i][a][0];
+                head->anchors[a][1] = DEFAULT_ANCHORS_P6[i][a][1];
+            } else {
+                printf("no default anchors for %d heads, set them in the model cfg\n", model->head_num);
+                return false;
+            }
+        }
+    }
+
+    if (cfg != NULL && cfg->names_num > 0){
+        if (cfg->names_num != model->class_num){
+            printf("cfg has %d names, the model has %d classes\n", cfg->names_num, model->class_num);
+            return false;
+        }
+        model->class_names = cfg->names;
+        model->class_names_num = cfg->names_num;
+    }
+    return true;
+}
+
+void yolov5_model_cfg_free(struct yolov5_model_cfg* cfg){
+    for (int i=0;i<cfg->names_num;i++){
+        free(cfg->names[i]);
+    }
+    free(cfg->names);
+    memset(cfg, 0, sizeof(*cfg));
+}
+#endif
@@ -0,0 +1,198 @@
+#ifndef MOSAIC_H
+#define MOSAIC_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "yolov5.h"
+#include "net.h"
+
+// one small image letterboxed into a cell of a grid x grid mosaic, so a
+// launch serves grid*grid images per batch item
+struct mosaic_slot {
+    const char* path;
+    unsigned char* img;     // NULL for an empty slot
+    int width;
+    int height;
+    int x0, y0, x1, y1;     // cell of the slot in net coordinates
+    int target_w;
+    int target_h;
+    struct resize_info r;   // letterbox into the cell, start_x/start_y in net coordinates
+};
+
+// cell s of a batch item and the letterbox of the slot image into it
+void mosaic_slot_init(struct mosaic_slot* slot, int s, int grid, int net_w, int net_h){
+    int col = s % grid, row = s / grid;
+    slot->x0 = col * net_w / grid;
+    slot->x1 = (col + 1) * net_w / grid;
+    slot->y0 = row * net_h / grid;
+    slot->y1 = (row + 1) * net_h / grid;
+    if (slot->img == NULL) return;
+
+    struct resize_info* r = &slot->r;
+    r->ori_w = slot->width;
+    r->ori_h = slot->height;
+    r->net_w = slot->x1 - slot->x0;
+    r->net_h = slot->y1 - slot->y0;
+    r->ratio_x = (float)r->net_w/r->ori_w;
+    r->ratio_y = (float)r->net_h/r->ori_h;
+    r->start_x = 0;
+    r->start_y = 0;
+    r->keep_aspect = true;
+    r->view_x = 0;
+    r->view_y = 0;
+    get_letterbox(r, &slot->target_w, &slot->target_h);
+    r->net_w = net_w;
+    r->net_h = net_h;
+    r->start_x += slot->x0;
+    r->start_y += slot->y0;
+}
+
+struct mosaic_job {
+    struct mosaic_slot* slots;
+    int grid;
+    float* input_data;
+    size_t item_size;   // floats of one batch item
+    int net_w;
+    int net_h;
+    float pad_value;
+};
+
+// pad the cell of slot s, then resize its image into the letterbox
+void mosaic_task(void* arg, int s){
+    struct mosaic_job* job = (struct mosaic_job*)arg;
+    struct mosaic_slot* slot = &job->slots[s];
+    int cells = job->grid * job->grid;
+    float* input_data = job->input_data + (s / cells) * job->item_size;
+    for (int k=0;k<3;k++){
+        float* plane = input_data + k * job->net_w * job->net_h;
+        for (int i=slot->y0;i<slot->y1;i++){
+            for (int j=slot->x0;j<slot->x1;j++) plane[i * job->net_w + j] = job->pad_value;
+        }
+    }
+    if (slot->img == NULL) return;
+
+    unsigned char* resized_img = (unsigned char*)malloc(slot->target_w * slot->target_h * 3);
+    stbir_resize_uint8_linear(slot->img, slot->width, slot->height, 0,
+            resized_img, slot->target_w, slot->target_h, 0, STBIR_RGB);
+    hwc_to_chw(resized_img, slot->target_w * 3, slot->target_w, 0, slot->target_h, input_data, &slot->r);
+    free(resized_img);
+}
+
+// cell of the mosaic the center of a box is in
+int mosaic_cell(int grid, int net_w, int net_h, const struct YoloV5Box* box){
+    float cx = box->x + box->w / 2, cy = box->y + box->h / 2;
+    int col = (int)(cx * grid / net_w), row = (int)(cy * grid / net_h);
+    if (col < 0) col = 0;
+    if (col >= grid) col = grid - 1;
+    if (row < 0) row = 0;
+    if (row >= grid) row = grid - 1;
+    return row * grid + col;
+}
+
+// clip a box of the mosaic to the letterbox of its slot and scale it to
+// the slot image. returns false if nothing of it is left
+bool mosaic_clip(const struct mosaic_slot* slot, struct YoloV5Box* box){
+    const struct resize_info* r = &slot->r;
+    float x1 = fmaxf(box->x, r->start_x), x2 = fminf(box->x + box->w, r->start_x + slot->target_w);
+    float y1 = fmaxf(box->y, r->start_y), y2 = fminf(box->y + box->h, r->start_y + slot->target_h);
+    if (x2 <= x1 || y2 <= y1) return false;
+    box->x = (x1 - r->start_x) / r->ratio_x;
+    box->y = (y1 - r->start_y) / r->ratio_y;
+    box->w = (x2 - x1) / r->ratio_x;
+    box->h = (y2 - y1) / r->ratio_y;
+    fix_box(box, slot->width, slot->height);
+    return true;
+}
+
+// detect on num images packed grid x grid into each batch item, and report
+// every image on its own
+void mosaic_run(struct bm_net* net, const struct yolov5_model* model, const struct yolov5_params* params,
+        char** paths, int num, int grid, float pad_value){
+    int net_w = model->net_w, net_h = model->net_h;
+    int cells = grid * grid;
+    int slot_num = cells * net->batch;
+    printf("mosaic: %d images, %d x %d cells of %dx%d, %d launches\n", num, grid, grid,
+            net_w / grid, net_h / grid, (num + slot_num - 1) / slot_num);
+
+    struct mosaic_slot* slots = (struct mosaic_slot*)malloc(slot_num * sizeof(struct mosaic_slot));
+    int* cell_first = (int*)malloc((cells + 1) * sizeof(int));
+    int* slot_first = (int*)malloc((slot_num + 1) * sizeof(int));
+    int routed_cap = slot_num;
+    struct YoloV5Box* routed = (struct YoloV5Box*)malloc(routed_cap * sizeof(struct YoloV5Box));
+    for (int first=0;first<num;first+=slot_num){
+        // read images, their slots follow the order of paths
+        memset(slots, 0, slot_num * sizeof(struct mosaic_slot));
+        for (int s=0;s<slot_num && first + s < num;s++){
+            struct mosaic_slot* slot = &slots[s];
+            int channels;
+            slot->path = paths[first + s];
+            slot->img = stbi_load(slot->path, &slot->width, &slot->height, &channels, 3);
+            if (slot->img == NULL) {
+                    printf("Error in loading the image\n");
+                    exit(1);
+            }
+            printf("img: %s, width = %d, height = %d, channels = %d\n", slot->path, slot->width, slot->height, channels);
+        }
+        for (int s=0;s<slot_num;s++) mosaic_slot_init(&slots[s], s % cells, grid, net_w, net_h);
+
+        struct mosaic_job job = {slots, grid, net->input_data, bm_net_input_count(net), net_w, net_h, pad_value};
+        thread_pool_run(params->pool, mosaic_task, &job, slot_num);
+        bm_net_upload(net);
+        bm_net_forward(net);
+
+        // candidates are split by the cell their center is in before the cap
+        // and NMS, so the images of a batch item never compete with each other
+        int routed_num = 0;
+        for (int b=0;b<net->batch;b++){
+            struct yolov5_output outputs[YOLOV5_MAX_HEADS];
+            bm_net_yolov5_outputs(net, b, outputs);
+            int cand_num;
+            struct YoloV5Box* cands = yolov5_decode(outputs, model, params, &cand_num);
+            struct YoloV5Box* sorted = (struct YoloV5Box*)malloc((cand_num + 1) * sizeof(struct YoloV5Box));
+            memset(cell_first, 0, (cells + 1) * sizeof(int));
+            for (int i=0;i<cand_num;i++)
+                cell_first[mosaic_cell(grid, net_w, net_h, &cands[i]) + 1]++;
+            for (int c=0;c<cells;c++) cell_first[c + 1] += cell_first[c];
+            for (int i=0;i<cand_num;i++)
+                sorted[cell_first[mosaic_cell(grid, net_w, net_h, &cands[i])]++] = cands[i];
+            free(cands);
+
+            // cell_first[c] is now where cell c ends
+            int begin = 0;
+            for (int c=0;c<cells;c++){
+                struct mosaic_slot* slot = &slots[b * cells + c];
+                int end = cell_first[c];
+                slot_first[b * cells + c] = routed_num;
+                if (slot->img != NULL){
+                    int det_num = yolov5_select(params, sorted + begin, end - begin);
+                    if (routed_num + det_num > routed_cap){
+                        routed_cap = (routed_num + det_num) * 2;
+                        routed = (struct YoloV5Box*)realloc(routed, routed_cap * sizeof(struct YoloV5Box));
+                    }
+                    for (int i=0;i<det_num;i++){
+                        routed[routed_num] = sorted[begin + i];
+                        if (mosaic_clip(slot, &routed[routed_num])) routed_num++;
+                    }
+                }
+                begin = end;
+            }
+            free(sorted);
+        }
+        slot_first[slot_num] = routed_num;
+        bm_net_release_outputs(net);
+
+        for (int s=0;s<slot_num;s++){
+            struct mosaic_slot* slot = &slots[s];
+            if (slot->img == NULL) continue;
+            printf("img: %s\n", slot->path);
+            yolov5_report(model, routed + slot_first[s], slot_first[s + 1] - slot_first[s],
+                    slot->path, slot->img, slot->width, slot->height);
+            stbi_image_free(slot->img);
+        }
+    }
+    free(slot_first);
+    free(cell_first);
+    free(routed);
+    free(slots);
+}
+#endif
@@ -0,0 +1,286 @@
+#ifndef NET_H
+#define NET_H
+
+#include <bmruntime_interface.h>
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "model.h"
+#include "decode.h"
+
+#define BM_NET_MAX_OUTPUTS YOLOV5_MAX_HEADS
+#define BM_MAX_BMODELS 8
+
+// one network of a loaded bmodel with its tensors and host buffers, kept
+// across frames
+struct bm_net {
+    bm_handle_t handle;
+    void* p_bmrt;
+    const char* name;
+    const bm_net_info_t* info;
+    bool is_soc;
+    bool own_mem;       // device memory allocated here, bm1688 has no stage mems
+    int stage;
+    int batch;
+    bm_tensor_t input;
+    bm_tensor_t outputs[BM_NET_MAX_OUTPUTS];
+    float* input_data;  // host view of the input, mapped on soc
+    void* output_data[BM_NET_MAX_OUTPUTS];
+};
+
+// load one more bmodel into p_bmrt, returns the name of the first network
+// it added, owned by p_bmrt
+const char* bm_net_load(void* p_bmrt, const char* path){
+    int before = bmrt_get_network_number(p_bmrt);
+    const char** names = NULL;
+    if (before > 0)
+        bmrt_get_network_names(p_bmrt, &names);
+    bool ret = bmrt_load_bmodel(p_bmrt, path);
+    if (!ret){
+        printf("Error in loading %s\n", path);
+        exit(1);
+    }
+    const char** all = NULL;
+    bmrt_get_network_names(p_bmrt, &all);
+    const char* name = NULL;
+    for (int i=0;i<bmrt_get_network_number(p_bmrt) && name == NULL;i++){
+        bool seen = false;
+        for (int j=0;j<before;j++) seen |= strcmp(all[i], names[j]) == 0;
+        if (!seen) name = all[i];
+    }
+    free(names);
+    free(all);
+    if (name == NULL){
+        printf("%s adds no network\n", path);
+        exit(1);
+    }
+    return name;
+}
+
+void bm_net_init(struct bm_net* net, bm_handle_t handle, void* p_bmrt, const char* name,
+        bool is_soc, bool is_1688){
+    bm_status_t status;
+    memset(net, 0, sizeof(*net));
+    net->handle = handle;
+    net->p_bmrt = p_bmrt;
+    net->name = name;
+    net->info = bmrt_get_network_info(p_bmrt, name);
+    assert(NULL != net->info);
+    net->is_soc = is_soc;
+    net->own_mem = is_1688;
+    const bm_net_info_t* info = net->info;
+    assert(info->input_num == 1 && info->output_num <= BM_NET_MAX_OUTPUTS);
+
+    // prepare input tensor and output tensor
+    net->input.dtype = info->input_dtypes[0];
+    if (net->own_mem)
+        bm_malloc_device_byte(handle, &net->input.device_mem, info->max_input_bytes[0]);
+    else
+        net->input.device_mem = info->stages[0].input_mems[0];
+    net->input.shape = info->stages[0].input_shapes[0];
+    net->input.st_mode = BM_STORE_1N;
+    net->batch = net->input.shape.dims[0];
+
+    for (int i=0;i<info->output_num;i++){
+        net->outputs[i].dtype = info->output_dtypes[i];
+        net->outputs[i].shape = info->stages[0].output_shapes[i];
+        if (net->own_mem)
+            bm_malloc_device_byte(handle, &net->outputs[i].device_mem, info->max_output_bytes[i]);
+        else
+            net->outputs[i].device_mem = info->stages[0].output_mems[i];
+        net->outputs[i].st_mode = BM_STORE_1N;
+    }
+
+    // input data memory lives across frames, so the letterbox border is written once
+    if (is_soc){
+        status = bm_mem_mmap_device_mem(handle, &net->input.device_mem,
+                (long long unsigned int*)&net->input_data);
+        assert(BM_SUCCESS == status);
+    } else {
+        net->input_data = (float*)malloc(net->info->max_input_bytes[0]);
+        for (int i=0;i<info->output_num;i++){
+            net->output_data[i] = malloc(info->max_output_bytes[i]);
+        }
+    }
+}
+
+// floats of one batch item of the input
+size_t bm_net_input_count(const struct bm_net* net){
+    return bmrt_shape_count(&net->input.shape) / net->batch;
+}
+
+// whether one batch item of the input of a fits the input of b as it is
+bool bm_net_same_input(const struct bm_net* a, const struct bm_net* b){
+    if (a->input.dtype != b->input.dtype || a->input.shape.num_dims != b->input.shape.num_dims)
+        return false;
+    for (int i=1;i<a->input.shape.num_dims;i++){
+        if (a->input.shape.dims[i] != b->input.shape.dims[i])
+            return false;
+    }
+    return true;
+}
+
+// switch the tensors to another stage of a dynamic shape bmodel. returns
+// true if the input moved to other device memory, whose contents, border
+// included, are unknown then, even if the host view kept its address
+bool bm_net_set_stage(struct bm_net* net, int stage){
+    if (stage == net->stage) return false;
+    const bm_stage_info_t* st = &net->info->stages[stage];
+    net->input.shape = st->input_shapes[0];
+    for (int i=0;i<net->info->output_num;i++){
+        net->outputs[i].shape = st->output_shapes[i];
+        if (!net->own_mem)
+            net->outputs[i].device_mem = st->output_mems[i];
+    }
+
+    // stages may have their own input memory, on soc the host view moves with it
+    bool moved = false;
+    if (!net->own_mem && bm_mem_get_device_addr(st->input_mems[0]) != bm_mem_get_device_addr(net->input.device_mem)){
+        moved = true;
+        if (net->is_soc){
+            bm_status_t status = bm_mem_unmap_device_mem(net->handle, net->input_data,
+                    bm_mem_get_device_size(net->input.device_mem));
+            assert(BM_SUCCESS == status);
+            net->input.device_mem = st->input_mems[0];
+            status = bm_mem_mmap_device_mem(net->handle, &net->input.device_mem,
+                    (long long unsigned int*)&net->input_data);
+            assert(BM_SUCCESS == status);
+        } else {
+            net->input.device_mem = st->input_mems[0];
+        }
+    }
+    net->stage = stage;
+    return moved;
+}
+
+// the stage whose letterbox of a width x height image pads the least share
+// of its input, the larger one on a tie. stages above max_area input pixels
+// are skipped if max_area > 0, the smallest stage is used if none fits
+int bm_net_pick_stage(const struct bm_net* net, int width, int height, int max_area){
+    const bm_net_info_t* info = net->info;
+    int best = -1, smallest = 0;
+    float best_pad = 0;
+    for (int s=0;s<info->stage_num;s++){
+        const bm_shape_t* shape = &info->stages[s].input_shapes[0];
+        int w = shape->dims[3], h = shape->dims[2];
+        const bm_shape_t* small = &info->stages[smallest].input_shapes[0];
+        if (w * h < small->dims[3] * small->dims[2]) smallest = s;
+        if (max_area > 0 && w * h > max_area) continue;
+
+        float ratio = fminf((float)w / width, (float)h / height);
+        float pad = 1 - (width * ratio) * (height * ratio) / (w * h);
+        if (best < 0 || pad < best_pad - 1e-3f){
+            best = s;
+            best_pad = pad;
+        } else if (pad < best_pad + 1e-3f){
+            const bm_shape_t* b = &info->stages[best].input_shapes[0];
+            if (w * h > b->dims[3] * b->dims[2]){
+                best = s;
+                best_pad = pad;
+            }
+        }
+    }
+    return best < 0 ? smallest : best;
+}
+
+// flush the cache or s2d the whole input
+void bm_net_upload(struct bm_net* net){
+    bm_status_t status;
+    if (net->is_soc){
+        status = bm_mem_flush_device_mem(net->handle, &net->input.device_mem);
+    } else {
+        status = bm_memcpy_s2d_partial(net->handle, net->input.device_mem,
+                (long long unsigned int*)net->input_data, bmrt_tensor_bytesize(&net->input));
+    }
+    assert(BM_SUCCESS == status);
+}
+
+// flush or s2d rows [row_begin, row_end) of every channel of batch item 0
+void bm_net_upload_rows(struct bm_net* net, int row_begin, int row_end){
+    bm_status_t status;
+    const bm_shape_t* shape = &net->input.shape;
+    unsigned row_bytes = shape->dims[3] * sizeof(float);
+    unsigned plane_bytes = shape->dims[2] * row_bytes;
+    unsigned offset = row_begin * row_bytes;
+    unsigned size = (row_end - row_begin) * row_bytes;
+    for (int k=0;k<shape->dims[1];k++){
+        if (net->is_soc){
+            status = bm_mem_flush_partial_device_mem(net->handle, &net->input.device_mem,
+                    offset + k * plane_bytes, size);
+        } else {
+            status = bm_memcpy_s2d_partial_offset(net->handle, net->input.device_mem,
+                    (char*)net->input_data + offset + k * plane_bytes, size, offset + k * plane_bytes);
+        }
+        assert(BM_SUCCESS == status);
+    }
+}
+
+// launch, wait, and make the outputs readable from output_data
+void bm_net_forward(struct bm_net* net){
+    bm_status_t status;
+    const bm_net_info_t* info = net->info;
+    // do inference
+    bool ret = bmrt_launch_tensor_ex(net->p_bmrt, net->name, &net->input, 1, net->outputs, info->output_num, true, false);
+    assert(true == ret);
+
+    // sync, wait for finishing inference
+    bm_thread_sync(net->handle);
+
+    // prepare output data, int8/fp16 heads are copied as they are
+    for (int i=0;i<info->output_num;i++){
+        if (net->is_soc){
+            status = bm_mem_mmap_device_mem(net->handle, &net->outputs[i].device_mem,
+                    (long long unsigned int*)&net->output_data[i]);
+            assert(BM_SUCCESS == status);
+            status = bm_mem_invalidate_device_mem(net->handle, &net->outputs[i].device_mem);
+        } else {
+            status = bm_memcpy_d2s_partial(net->handle, net->output_data[i], net->outputs[i].device_mem,
+                    bmrt_tensor_bytesize(&net->outputs[i]));
+        }
+        assert(BM_SUCCESS == status);
+    }
+}
+
+// done with the outputs of the last forward
+void bm_net_release_outputs(struct bm_net* net){
+    if (!net->is_soc) return;
+    for (int i=0;i<net->info->output_num;i++){
+        bm_status_t status = bm_mem_unmap_device_mem(net->handle, net->output_data[i],
+                bm_mem_get_device_size(net->outputs[i].device_mem));
+        assert(BM_SUCCESS == status);
+    }
+}
+
+// raw outputs of batch item b
+void bm_net_yolov5_outputs(const struct bm_net* net, int b, struct yolov5_output* outputs){
+    for (int i=0;i<net->info->output_num;i++){
+        size_t item_bytes = bmrt_tensor_bytesize(&net->outputs[i]) / net->batch;
+        outputs[i].data = (const char*)net->output_data[i] + b * item_bytes;
+        outputs[i].dtype = net->outputs[i].dtype;
+        outputs[i].scale = net->info->output_scales[i];
+    }
+}
+
+void bm_net_free(struct bm_net* net){
+    if (net->is_soc){
+        bm_status_t status = bm_mem_unmap_device_mem(net->handle, net->input_data,
+                bm_mem_get_device_size(net->input.device_mem));
+        assert(BM_SUCCESS == status);
+    } else {
+        free(net->input_data);
+        for (int i=0;i<net->info->output_num;i++){
+            free(net->output_data[i]);
+        }
+    }
+
+    // at last, free device memory
+    if (net->own_mem){
+        bm_free_device(net->handle, net->input.device_mem);
+        for (int i=0;i<net->info->output_num;i++){
+            bm_free_device(net->handle, net->outputs[i].device_mem);
+        }
+    }
+}
+#endif
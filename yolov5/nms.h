@@ -0,0 +1,704 @@
+#ifndef NMS_H
+#define NMS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "utils.h"
+#include "threadpool.h"
+
+// NMS backends, all of them are per class
+enum nms_mode {
+    NMS_PAIRWISE,   // NMS of utils.h, pairs in decode order
+    NMS_BITMASK,    // greedy by score, IoU rows as 64-bit masks
+    NMS_GRID,       // greedy by score, only boxes sharing a grid cell are tested
+    NMS_DIOU,       // bitmask sweep on DIoU
+    NMS_SOFT_LINEAR,    // soft-NMS, scores decay by 1 - IoU above the threshold
+    NMS_SOFT_GAUSSIAN,  // soft-NMS, scores decay by exp(-IoU^2 / sigma)
+};
+
+#define NMS_SOFT_SIGMA 0.5f
+
+// candidates sorted by class, then by score, as SoA for the IoU kernels
+struct nms_soa {
+    int num;
+    int* order;     // original index of each sorted candidate
+    int* class_id;
+    float* x1;
+    float* y1;
+    float* x2;
+    float* y2;
+    float* area;
+    float* score;
+};
+
+struct nms_key {
+    unsigned class_id;
+    float score;
+    int idx;
+};
+
+int nms_key_compare(const void* a, const void* b){
+    const struct nms_key* ka = (const struct nms_key*)a;
+    const struct nms_key* kb = (const struct nms_key*)b;
+    if (ka->class_id != kb->class_id) return ka->class_id < kb->class_id ? -1 : 1;
+    if (ka->score != kb->score) return ka->score > kb->score ? -1 : 1;
+    return ka->idx - kb->idx;
+}
+
+// arrays are padded to a multiple of 4, so the kernels can load past the end
+void nms_soa_init(struct nms_soa* soa, const struct YoloV5Box* dets, int length){
+    int padded = (length + 3) & ~3;
+    struct nms_key* keys = (struct nms_key*)malloc(length * sizeof(struct nms_key));
+    for (int i=0;i<length;i++){
+        keys[i].class_id = dets[i].class_id;
+        keys[i].score = dets[i].score;
+        keys[i].idx = i;
+    }
+    qsort(keys, length, sizeof(struct nms_key), nms_key_compare);
+
+    soa->num = length;
+    soa->order = (int*)malloc(padded * sizeof(int));
+    soa->class_id = (int*)malloc(padded * sizeof(int));
+    float* buf = (float*)calloc(6 * padded, sizeof(float));
+    soa->x1 = buf;
+    soa->y1 = buf + padded;
+    soa->x2 = buf + 2 * padded;
+    soa->y2 = buf + 3 * padded;
+    soa->area = buf + 4 * padded;
+    soa->score = buf + 5 * padded;
+    for (int i=0;i<length;i++){
+        const struct YoloV5Box* d = &dets[keys[i].idx];
+        soa->order[i] = keys[i].idx;
+        soa->class_id[i] = keys[i].class_id;
+        soa->x1[i] = d->x;
+        soa->y1[i] = d->y;
+        soa->x2[i] = d->x + d->w;
+        soa->y2[i] = d->y + d->h;
+        soa->area[i] = d->w * d->h;
+        soa->score[i] = d->score;
+    }
+    free(keys);
+}
+
+static inline void nms_swap_f(float* v, int a, int b){
+    float t = v[a];
+    v[a] = v[b];
+    v[b] = t;
+}
+
+void nms_soa_swap(struct nms_soa* soa, int a, int b){
+    int t = soa->order[a];
+    soa->order[a] = soa->order[b];
+    soa->order[b] = t;
+    t = soa->class_id[a];
+    soa->class_id[a] = soa->class_id[b];
+    soa->class_id[b] = t;
+    nms_swap_f(soa->x1, a, b);
+    nms_swap_f(soa->y1, a, b);
+    nms_swap_f(soa->x2, a, b);
+    nms_swap_f(soa->y2, a, b);
+    nms_swap_f(soa->area, a, b);
+    nms_swap_f(soa->score, a, b);
+}
+
+void nms_soa_free(struct nms_soa* soa){
+    free(soa->order);
+    free(soa->class_id);
+    free(soa->x1);
+    memset(soa, 0, sizeof(*soa));
+}
+
+// 4 candidates from j against candidate i, the IoU uses the arithmetic of
+// calculate_iou so the decisions match it
+#if defined(__ARM_NEON)
+typedef float32x4_t nms_f32x4;
+
+static inline float32x4_t nms_div4(float32x4_t a, float32x4_t b){
+#if defined(__aarch64__)
+    return vdivq_f32(a, b);
+#else
+    // no vector divide on armv7
+    float fa[4], fb[4];
+    vst1q_f32(fa, a);
+    vst1q_f32(fb, b);
+    for (int k=0;k<4;k++) fa[k] /= fb[k];
+    return vld1q_f32(fa);
+#endif
+}
+
+static inline unsigned nms_mask4(uint32x4_t m){
+    const uint32_t bits[4] = {1, 2, 4, 8};
+    uint32x4_t v = vandq_u32(m, vld1q_u32(bits));
+    uint32x2_t v2 = vorr_u32(vget_low_u32(v), vget_high_u32(v));
+    return vget_lane_u32(vpadd_u32(v2, v2), 0);
+}
+
+static inline nms_f32x4 nms_iou4(const struct nms_soa* soa, int i, int j){
+    float32x4_t x1 = vmaxq_f32(vdupq_n_f32(soa->x1[i]), vld1q_f32(soa->x1 + j));
+    float32x4_t y1 = vmaxq_f32(vdupq_n_f32(soa->y1[i]), vld1q_f32(soa->y1 + j));
+    float32x4_t x2 = vminq_f32(vdupq_n_f32(soa->x2[i]), vld1q_f32(soa->x2 + j));
+    float32x4_t y2 = vminq_f32(vdupq_n_f32(soa->y2[i]), vld1q_f32(soa->y2 + j));
+    float32x4_t eps = vdupq_n_f32(0.00001f), zero = vdupq_n_f32(0);
+    float32x4_t inter = vmulq_f32(vmaxq_f32(zero, vaddq_f32(vsubq_f32(x2, x1), eps)),
+            vmaxq_f32(zero, vaddq_f32(vsubq_f32(y2, y1), eps)));
+    float32x4_t uni = vsubq_f32(vaddq_f32(vdupq_n_f32(soa->area[i]), vld1q_f32(soa->area + j)), inter);
+    return nms_div4(inter, uni);
+}
+
+// IoU minus the squared center distance over the squared enclosing diagonal
+static inline nms_f32x4 nms_diou4(const struct nms_soa* soa, int i, int j){
+    float32x4_t jx1 = vld1q_f32(soa->x1 + j), jy1 = vld1q_f32(soa->y1 + j);
+    float32x4_t jx2 = vld1q_f32(soa->x2 + j), jy2 = vld1q_f32(soa->y2 + j);
+    float32x4_t half = vdupq_n_f32(0.5f);
+    float32x4_t dx = vmulq_f32(vsubq_f32(vdupq_n_f32(soa->x1[i] + soa->x2[i]), vaddq_f32(jx1, jx2)), half);
+    float32x4_t dy = vmulq_f32(vsubq_f32(vdupq_n_f32(soa->y1[i] + soa->y2[i]), vaddq_f32(jy1, jy2)), half);
+    float32x4_t cw = vsubq_f32(vmaxq_f32(vdupq_n_f32(soa->x2[i]), jx2), vminq_f32(vdupq_n_f32(soa->x1[i]), jx1));
+    float32x4_t ch = vsubq_f32(vmaxq_f32(vdupq_n_f32(soa->y2[i]), jy2), vminq_f32(vdupq_n_f32(soa->y1[i]), jy1));
+    float32x4_t d2 = vaddq_f32(vmulq_f32(dx, dx), vmulq_f32(dy, dy));
+    float32x4_t c2 = vaddq_f32(vaddq_f32(vmulq_f32(cw, cw), vmulq_f32(ch, ch)), vdupq_n_f32(1e-7f));
+    return vsubq_f32(nms_iou4(soa, i, j), nms_div4(d2, c2));
+}
+
+static inline unsigned nms_gt4(nms_f32x4 v, float thresh){
+    return nms_mask4(vcgtq_f32(v, vdupq_n_f32(thresh)));
+}
+#elif defined(__SSE4_1__)
+typedef __m128 nms_f32x4;
+
+static inline nms_f32x4 nms_iou4(const struct nms_soa* soa, int i, int j){
+    __m128 x1 = _mm_max_ps(_mm_set1_ps(soa->x1[i]), _mm_loadu_ps(soa->x1 + j));
+    __m128 y1 = _mm_max_ps(_mm_set1_ps(soa->y1[i]), _mm_loadu_ps(soa->y1 + j));
+    __m128 x2 = _mm_min_ps(_mm_set1_ps(soa->x2[i]), _mm_loadu_ps(soa->x2 + j));
+    __m128 y2 = _mm_min_ps(_mm_set1_ps(soa->y2[i]), _mm_loadu_ps(soa->y2 + j));
+    __m128 eps = _mm_set1_ps(0.00001f), zero = _mm_setzero_ps();
+    __m128 inter = _mm_mul_ps(_mm_max_ps(zero, _mm_add_ps(_mm_sub_ps(x2, x1), eps)),
+            _mm_max_ps(zero, _mm_add_ps(_mm_sub_ps(y2, y1), eps)));
+    __m128 uni = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(soa->area[i]), _mm_loadu_ps(soa->area + j)), inter);
+    return _mm_div_ps(inter, uni);
+}
+
+// IoU minus the squared center distance over the squared enclosing diagonal
+static inline nms_f32x4 nms_diou4(const struct nms_soa* soa, int i, int j){
+    __m128 jx1 = _mm_loadu_ps(soa->x1 + j), jy1 = _mm_loadu_ps(soa->y1 + j);
+    __m128 jx2 = _mm_loadu_ps(soa->x2 + j), jy2 = _mm_loadu_ps(soa->y2 + j);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 dx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(soa->x1[i] + soa->x2[i]), _mm_add_ps(jx1, jx2)), half);
+    __m128 dy = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(soa->y1[i] + soa->y2[i]), _mm_add_ps(jy1, jy2)), half);
+    __m128 cw = _mm_sub_ps(_mm_max_ps(_mm_set1_ps(soa->x2[i]), jx2), _mm_min_ps(_mm_set1_ps(soa->x1[i]), jx1));
+    __m128 ch = _mm_sub_ps(_mm_max_ps(_mm_set1_ps(soa->y2[i]), jy2), _mm_min_ps(_mm_set1_ps(soa->y1[i]), jy1));
+    __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+    __m128 c2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cw, cw), _mm_mul_ps(ch, ch)), _mm_set1_ps(1e-7f));
+    return _mm_sub_ps(nms_iou4(soa, i, j), _mm_div_ps(d2, c2));
+}
+
+static inline unsigned nms_gt4(nms_f32x4 v, float thresh){
+    return _mm_movemask_ps(_mm_cmpgt_ps(v, _mm_set1_ps(thresh)));
+}
+#else
+typedef struct { float v[4]; } nms_f32x4;
+
+static inline nms_f32x4 nms_iou4(const struct nms_soa* soa, int i, int j){
+    nms_f32x4 r;
+    for (int k=0;k<4;k++){
+        float x1 = fmaxf(soa->x1[i], soa->x1[j+k]);
+        float y1 = fmaxf(soa->y1[i], soa->y1[j+k]);
+        float x2 = fminf(soa->x2[i], soa->x2[j+k]);
+        float y2 = fminf(soa->y2[i], soa->y2[j+k]);
+        float inter = fmaxf(0.0f, x2 - x1 + 0.00001f) * fmaxf(0.0f, y2 - y1 + 0.00001f);
+        r.v[k] = inter / (soa->area[i] + soa->area[j+k] - inter);
+    }
+    return r;
+}
+
+static inline nms_f32x4 nms_diou4(const struct nms_soa* soa, int i, int j){
+    nms_f32x4 r = nms_iou4(soa, i, j);
+    for (int k=0;k<4;k++){
+        float dx = ((soa->x1[i] + soa->x2[i]) - (soa->x1[j+k] + soa->x2[j+k])) * 0.5f;
+        float dy = ((soa->y1[i] + soa->y2[i]) - (soa->y1[j+k] + soa->y2[j+k])) * 0.5f;
+        float cw = fmaxf(soa->x2[i], soa->x2[j+k]) - fminf(soa->x1[i], soa->x1[j+k]);
+        float ch = fmaxf(soa->y2[i], soa->y2[j+k]) - fminf(soa->y1[i], soa->y1[j+k]);
+        r.v[k] -= (dx * dx + dy * dy) / (cw * cw + ch * ch + 1e-7f);
+    }
+    return r;
+}
+
+static inline unsigned nms_gt4(nms_f32x4 v, float thresh){
+    unsigned mask = 0;
+    for (int k=0;k<4;k++) mask |= (v.v[k] > thresh) << k;
+    return mask;
+}
+#endif
+
+// bit k is set when IoU(i, j+k) > thresh
+static inline unsigned nms_iou_gt4(const struct nms_soa* soa, int i, int j, float thresh){
+    return nms_gt4(nms_iou4(soa, i, j), thresh);
+}
+
+// bit k is set when DIoU(i, j+k) > thresh
+static inline unsigned nms_diou_gt4(const struct nms_soa* soa, int i, int j, float thresh){
+    return nms_gt4(nms_diou4(soa, i, j), thresh);
+}
+
+// greedy NMS on score sorted boxes the way it is done on gpus: the row of a
+// kept box is packed into 64-bit words of IoU > thresh bits and or-ed into
+// the suppressed bitset. rows of suppressed boxes are never computed, and
+// words that are already fully suppressed are skipped
+static inline __attribute__((always_inline))
+void nms_bitmask_sweep(struct YoloV5Box* dets, bool* keep, float nmsConfidence, int length, bool diou){
+    struct nms_soa soa;
+    nms_soa_init(&soa, dets, length);
+    int words = (length + 63) / 64;
+    uint64_t* removed = (uint64_t*)calloc(words, sizeof(uint64_t));
+
+    for (int begin = 0, end; begin < length; begin = end){
+        // boxes of one class are contiguous after sorting
+        end = begin + 1;
+        while (end < length && soa.class_id[end] == soa.class_id[begin]) end++;
+
+        for (int i = begin; i < end; i++){
+            if ((removed[i >> 6] >> (i & 63)) & 1){
+                keep[soa.order[i]] = false;
+                continue;
+            }
+            keep[soa.order[i]] = true;
+            // 4 aligned lanes never straddle a word
+            for (int j = (i + 1) & ~3; j < end; j += 4){
+                uint64_t* word = &removed[j >> 6];
+                unsigned shift = j & 63;
+                if (*word == ~(uint64_t)0){
+                    j = (j | 63) - 3;
+                    continue;
+                }
+                unsigned mask = diou ? nms_diou_gt4(&soa, i, j, nmsConfidence)
+                        : nms_iou_gt4(&soa, i, j, nmsConfidence);
+                // drop lanes at or before i and past the class
+                if (j <= i) mask &= ~0u << (i + 1 - j);
+                if (end - j < 4) mask &= (1u << (end - j)) - 1;
+                *word |= (uint64_t)mask << shift;
+            }
+        }
+    }
+
+    free(removed);
+    nms_soa_free(&soa);
+}
+
+void NMS_bitmask(struct YoloV5Box* dets, bool* keep, float nmsConfidence, int length){
+    nms_bitmask_sweep(dets, keep, nmsConfidence, length, false);
+}
+
+// DIoU-NMS, the bitmask sweep with DIoU in place of IoU, so of two boxes
+// with the same IoU the one with the closer center is suppressed first
+void NMS_diou(struct YoloV5Box* dets, bool* keep, float nmsConfidence, int length){
+    nms_bitmask_sweep(dets, keep, nmsConfidence, length, true);
+}
+
+// IoU(i, j) with the arithmetic of calculate_iou
+static inline float nms_iou(const struct nms_soa* soa, int i, int j){
+    float x1 = fmaxf(soa->x1[i], soa->x1[j]);
+    float y1 = fmaxf(soa->y1[i], soa->y1[j]);
+    float x2 = fminf(soa->x2[i], soa->x2[j]);
+    float y2 = fminf(soa->y2[i], soa->y2[j]);
+    float inter = fmaxf(0.0f, x2 - x1 + 0.00001f) * fmaxf(0.0f, y2 - y1 + 0.00001f);
+    return inter / (soa->area[i] + soa->area[j] - inter);
+}
+
+// uniform grid over the boxes of one class, every box is listed in each
+// cell it covers, so two overlapping boxes always share a cell
+struct nms_grid {
+    float x0;
+    float y0;
+    float inv_cell;
+    int grid_w;
+    int grid_h;
+    int* cell_start;    // grid_w*grid_h+1 offsets into items
+    int* items;         // sorted candidate indices, ascending in every cell
+};
+
+static inline void nms_grid_span(const struct nms_grid* g, const struct nms_soa* soa, int i,
+        int* cx0, int* cy0, int* cx1, int* cy1){
+    *cx0 = (int)((soa->x1[i] - g->x0) * g->inv_cell);
+    *cy0 = (int)((soa->y1[i] - g->y0) * g->inv_cell);
+    *cx1 = (int)((soa->x2[i] - g->x0) * g->inv_cell);
+    *cy1 = (int)((soa->y2[i] - g->y0) * g->inv_cell);
+    if (*cx1 >= g->grid_w) *cx1 = g->grid_w - 1;
+    if (*cy1 >= g->grid_h) *cy1 = g->grid_h - 1;
+}
+
+// cells are about the mean box size, grown when the grid would have more
+// than 4 cells per box
+void nms_grid_build(struct nms_grid* g, const struct nms_soa* soa, int begin, int end){
+    int n = end - begin;
+    float x0 = soa->x1[begin], y0 = soa->y1[begin], x1 = soa->x2[begin], y1 = soa->y2[begin];
+    double size = 0;
+    for (int i=begin;i<end;i++){
+        x0 = fminf(x0, soa->x1[i]);
+        y0 = fminf(y0, soa->y1[i]);
+        x1 = fmaxf(x1, soa->x2[i]);
+        y1 = fmaxf(y1, soa->y2[i]);
+        size += (soa->x2[i] - soa->x1[i]) + (soa->y2[i] - soa->y1[i]);
+    }
+    float cell = fmaxf((float)(size / (2 * n)), 1.0f);
+    float span_w = fmaxf(x1 - x0, 1.0f), span_h = fmaxf(y1 - y0, 1.0f);
+    if (span_w / cell * (span_h / cell) > 4.0f * n + 16)
+        cell = sqrtf(span_w * span_h / (4.0f * n + 16));
+    g->x0 = x0;
+    g->y0 = y0;
+    g->inv_cell = 1.0f / cell;
+    g->grid_w = (int)(span_w * g->inv_cell) + 1;
+    g->grid_h = (int)(span_h * g->inv_cell) + 1;
+
+    // counting sort of (cell, box) pairs
+    int cells = g->grid_w * g->grid_h;
+    g->cell_start = (int*)calloc(cells + 1, sizeof(int));
+    for (int i=begin;i<end;i++){
+        int cx0, cy0, cx1, cy1;
+        nms_grid_span(g, soa, i, &cx0, &cy0, &cx1, &cy1);
+        for (int cy=cy0;cy<=cy1;cy++)
+            for (int cx=cx0;cx<=cx1;cx++) g->cell_start[cy * g->grid_w + cx + 1]++;
+    }
+    for (int c=0;c<cells;c++) g->cell_start[c+1] += g->cell_start[c];
+    g->items = (int*)malloc(g->cell_start[cells] * sizeof(int));
+    int* fill = (int*)malloc(cells * sizeof(int));
+    memcpy(fill, g->cell_start, cells * sizeof(int));
+    for (int i=begin;i<end;i++){
+        int cx0, cy0, cx1, cy1;
+        nms_grid_span(g, soa, i, &cx0, &cy0, &cx1, &cy1);
+        for (int cy=cy0;cy<=cy1;cy++)
+            for (int cx=cx0;cx<=cx1;cx++) g->items[fill[cy * g->grid_w + cx]++] = i;
+    }
+    free(fill);
+}
+
+void nms_grid_free(struct nms_grid* g){
+    free(g->cell_start);
+    free(g->items);
+}
+
+// greedy NMS on score sorted boxes, a kept box only tests the boxes listed
+// in the cells it covers. close to O(n) when the boxes are spread out
+void NMS_grid(struct YoloV5Box* dets, bool* keep, float nmsConfidence, int length){
+    struct nms_soa soa;
+    nms_soa_init(&soa, dets, length);
+    bool* removed = (bool*)calloc(length, sizeof(bool));
+    int* seen = (int*)malloc(length * sizeof(int));
+    for (int i=0;i<length;i++) seen[i] = -1;
+
+    for (int begin = 0, end; begin < length; begin = end){
+        end = begin + 1;
+        while (end < length && soa.class_id[end] == soa.class_id[begin]) end++;
+
+        struct nms_grid grid;
+        nms_grid_build(&grid, &soa, begin, end);
+        for (int i = begin; i < end; i++){
+            keep[soa.order[i]] = !removed[i];
+            if (removed[i]) continue;
+            int cx0, cy0, cx1, cy1;
+            nms_grid_span(&grid, &soa, i, &cx0, &cy0, &cx1, &cy1);
+            for (int cy=cy0;cy<=cy1;cy++){
+                for (int cx=cx0;cx<=cx1;cx++){
+                    int c = cy * grid.grid_w + cx;
+                    for (int k=grid.cell_start[c];k<grid.cell_start[c+1];k++){
+                        int j = grid.items[k];
+                        // boxes spanning several cells are tested once
+                        if (j <= i || removed[j] || seen[j] == i) continue;
+                        seen[j] = i;
+                        if (nms_iou(&soa, i, j) > nmsConfidence) removed[j] = true;
+                    }
+                }
+            }
+        }
+        nms_grid_free(&grid);
+    }
+
+    free(seen);
+    free(removed);
+    nms_soa_free(&soa);
+}
+
+// soft-NMS decay of candidate j by the kept candidate i, true when the
+// score falls to score_thresh or below
+static inline bool nms_soft_decay1(struct nms_soa* soa, int i, int j, float nmsConfidence,
+        float score_thresh, bool gaussian){
+    float iou = nms_iou(soa, i, j);
+    if (gaussian){
+        if (iou > 0) soa->score[j] *= expf(-iou * iou / NMS_SOFT_SIGMA);
+    } else if (iou > nmsConfidence){
+        soa->score[j] *= 1 - iou;
+    }
+    return soa->score[j] <= score_thresh;
+}
+
+// 4 lanes of nms_soft_decay1, returns the dropped lanes as bits. gaussian
+// lanes without overlap keep their score, so exp only runs for the few
+// lanes that overlap
+static inline unsigned nms_soft_decay4(struct nms_soa* soa, int i, int j, float nmsConfidence,
+        float score_thresh, bool gaussian){
+#if defined(__ARM_NEON)
+    float32x4_t iou = nms_iou4(soa, i, j);
+    float32x4_t s = vld1q_f32(soa->score + j);
+    if (gaussian){
+        unsigned m = nms_mask4(vcgtq_f32(iou, vdupq_n_f32(0)));
+        if (m){
+            float f[4];
+            vst1q_f32(f, iou);
+            for (int k=0;k<4;k++) f[k] = (m >> k) & 1 ? expf(-f[k] * f[k] / NMS_SOFT_SIGMA) : 1.0f;
+            s = vmulq_f32(s, vld1q_f32(f));
+        }
+    } else {
+        float32x4_t decayed = vmulq_f32(s, vsubq_f32(vdupq_n_f32(1.0f), iou));
+        s = vbslq_f32(vcgtq_f32(iou, vdupq_n_f32(nmsConfidence)), decayed, s);
+    }
+    vst1q_f32(soa->score + j, s);
+    return nms_mask4(vcleq_f32(s, vdupq_n_f32(score_thresh)));
+#elif defined(__SSE4_1__)
+    __m128 iou = nms_iou4(soa, i, j);
+    __m128 s = _mm_loadu_ps(soa->score + j);
+    if (gaussian){
+        int m = _mm_movemask_ps(_mm_cmpgt_ps(iou, _mm_setzero_ps()));
+        if (m){
+            float f[4];
+            _mm_storeu_ps(f, iou);
+            for (int k=0;k<4;k++) f[k] = (m >> k) & 1 ? expf(-f[k] * f[k] / NMS_SOFT_SIGMA) : 1.0f;
+            s = _mm_mul_ps(s, _mm_loadu_ps(f));
+        }
+    } else {
+        __m128 decayed = _mm_mul_ps(s, _mm_sub_ps(_mm_set1_ps(1.0f), iou));
+        s = _mm_blendv_ps(s, decayed, _mm_cmpgt_ps(iou, _mm_set1_ps(nmsConfidence)));
+    }
+    _mm_storeu_ps(soa->score + j, s);
+    return _mm_movemask_ps(_mm_cmple_ps(s, _mm_set1_ps(score_thresh)));
+#else
+    unsigned mask = 0;
+    for (int k=0;k<4;k++)
+        mask |= nms_soft_decay1(soa, i, j + k, nmsConfidence, score_thresh, gaussian) << k;
+    return mask;
+#endif
+}
+
+// soft-NMS: the best remaining box is kept, the others of its class decay
+// by their overlap with it instead of being removed, and leave once their
+// score is at or below score_thresh. kept boxes get their decayed score
+void NMS_soft(struct YoloV5Box* dets, bool* keep, float nmsConfidence, float score_thresh,
+        int length, bool gaussian){
+    struct nms_soa soa;
+    nms_soa_init(&soa, dets, length);
+    int* drop = (int*)malloc(length * sizeof(int));
+    memset(keep, false, length * sizeof(bool));
+
+    for (int begin = 0, class_end; begin < length; begin = class_end){
+        class_end = begin + 1;
+        while (class_end < length && soa.class_id[class_end] == soa.class_id[begin]) class_end++;
+
+        int end = class_end;
+        for (int i = begin; i < end; i++){
+            float best = soa.score[i];
+            unsigned m = 0;
+#if defined(__ARM_NEON)
+            argmax_neon(&soa.score[i], end - i, &best, &m);
+#elif defined(__SSE4_1__)
+            argmax_sse(&soa.score[i], end - i, &best, &m);
+#else
+            argmax(&soa.score[i], end - i, &best, &m);
+#endif
+            nms_soa_swap(&soa, i, i + m);
+            keep[soa.order[i]] = true;
+            dets[soa.order[i]].score = best;
+
+            int drop_num = 0, j = i + 1;
+            for (; j + 4 <= end; j += 4){
+                unsigned dropped = nms_soft_decay4(&soa, i, j, nmsConfidence, score_thresh, gaussian);
+                while (dropped){
+                    drop[drop_num++] = j + __builtin_ctz(dropped);
+                    dropped &= dropped - 1;
+                }
+            }
+            for (; j < end; j++){
+                if (nms_soft_decay1(&soa, i, j, nmsConfidence, score_thresh, gaussian)) drop[drop_num++] = j;
+            }
+            // swap the dropped boxes out from the highest index down,
+            // so the lower ones are still where drop says
+            for (int k = drop_num - 1; k >= 0; k--) nms_soa_swap(&soa, drop[k], --end);
+        }
+    }
+
+    free(drop);
+    nms_soa_free(&soa);
+}
+
+// score_thresh is only used by soft-NMS, which also rewrites the scores
+void nms_run(enum nms_mode mode, struct YoloV5Box* dets, bool* keep, float nmsConfidence,
+        float score_thresh, int length){
+    switch (mode){
+    case NMS_BITMASK:
+        NMS_bitmask(dets, keep, nmsConfidence, length);
+        break;
+    case NMS_GRID:
+        NMS_grid(dets, keep, nmsConfidence, length);
+        break;
+    case NMS_DIOU:
+        NMS_diou(dets, keep, nmsConfidence, length);
+        break;
+    case NMS_SOFT_LINEAR:
+    case NMS_SOFT_GAUSSIAN:
+        NMS_soft(dets, keep, nmsConfidence, score_thresh, length, mode == NMS_SOFT_GAUSSIAN);
+        break;
+    default:
+        NMS(dets, keep, nmsConfidence, length);
+        break;
+    }
+}
+
+// parse the name of a mode, returns false for unknown names
+bool nms_mode_parse(const char* name, enum nms_mode* mode){
+    if (strcmp(name, "pairwise") == 0){
+        *mode = NMS_PAIRWISE;
+    } else if (strcmp(name, "bitmask") == 0){
+        *mode = NMS_BITMASK;
+    } else if (strcmp(name, "grid") == 0){
+        *mode = NMS_GRID;
+    } else if (strcmp(name, "diou") == 0){
+        *mode = NMS_DIOU;
+    } else if (strcmp(name, "soft-linear") == 0){
+        *mode = NMS_SOFT_LINEAR;
+    } else if (strcmp(name, "soft-gaussian") == 0){
+        *mode = NMS_SOFT_GAUSSIAN;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// score weighted sums of the boxes fused into one
+struct wbf_cluster {
+    struct YoloV5Box box;   // current fused box
+    float area;
+    float score_sum;
+    float x1, y1, x2, y2;   // corners weighted by score
+    int count;
+};
+
+// weighted box fusion, for detections of overlapping views of one image.
+// best first, a box joins the fused box of its class it overlaps most if
+// the IoU is above thresh, else it starts a new one. corners are averaged
+// weighted by score, the score is the mean of the members. dets is
+// rewritten with the fused boxes, best first, returns their number
+int WBF(struct YoloV5Box* dets, float thresh, int length){
+    qsort(dets, length, sizeof(struct YoloV5Box), compare_score_desc);
+    struct wbf_cluster* clusters = (struct wbf_cluster*)malloc(length * sizeof(struct wbf_cluster));
+    int num = 0;
+    for (int i=0;i<length;i++){
+        struct YoloV5Box* det = &dets[i];
+        float area = det->w * det->h;
+        int best = -1;
+        float best_iou = thresh;
+        for (int c=0;c<num;c++){
+            if (clusters[c].box.class_id != det->class_id) continue;
+            float iou = calculate_iou(&clusters[c].box, det, &clusters[c].area, &area);
+            if (iou > best_iou){
+                best_iou = iou;
+                best = c;
+            }
+        }
+        struct wbf_cluster* cl = &clusters[best >= 0 ? best : num++];
+        if (best < 0) memset(cl, 0, sizeof(*cl));
+        float s = det->score;
+        cl->score_sum += s;
+        cl->x1 += s * det->x;
+        cl->y1 += s * det->y;
+        cl->x2 += s * (det->x + det->w);
+        cl->y2 += s * (det->y + det->h);
+        cl->count++;
+        cl->box.x = cl->x1 / cl->score_sum;
+        cl->box.y = cl->y1 / cl->score_sum;
+        cl->box.w = cl->x2 / cl->score_sum - cl->box.x;
+        cl->box.h = cl->y2 / cl->score_sum - cl->box.y;
+        cl->box.score = cl->score_sum / cl->count;
+        cl->box.class_id = det->class_id;
+        cl->area = cl->box.w * cl->box.h;
+    }
+    for (int c=0;c<num;c++) dets[c] = clusters[c].box;
+    free(clusters);
+    qsort(dets, num, sizeof(struct YoloV5Box), compare_score_desc);
+    return num;
+}
+
+// the candidates of one class, a task of the parallel NMS
+struct nms_class_job {
+    enum nms_mode mode;
+    struct YoloV5Box* dets;     // grouped by class
+    bool* keep;
+    float nmsConfidence;
+    float score_thresh;
+    int* class_start;
+    int* task_class;            // class of each task, biggest first
+};
+
+void nms_class_task(void* arg, int i){
+    struct nms_class_job* job = (struct nms_class_job*)arg;
+    int c = job->task_class[i];
+    int begin = job->class_start[c], n = job->class_start[c+1] - begin;
+    nms_run(job->mode, job->dets + begin, job->keep + begin, job->nmsConfidence, job->score_thresh, n);
+}
+
+// nms_run with the classes spread over the pool. a stable counting sort
+// groups the candidates by class, every backend only compares boxes of one
+// class, and the results are scattered back by index, so keep and the
+// scores are the same as with the serial run whatever the scheduling
+void nms_run_parallel(struct thread_pool* pool, enum nms_mode mode, struct YoloV5Box* dets, bool* keep,
+        float nmsConfidence, float score_thresh, int length){
+    if (thread_pool_size(pool) == 1 || length < 2){
+        nms_run(mode, dets, keep, nmsConfidence, score_thresh, length);
+        return;
+    }
+    int class_num = 0;
+    for (int i=0;i<length;i++){
+        if ((int)dets[i].class_id >= class_num) class_num = dets[i].class_id + 1;
+    }
+    int* class_start = (int*)calloc(class_num + 1, sizeof(int));
+    for (int i=0;i<length;i++) class_start[dets[i].class_id + 1]++;
+    for (int c=0;c<class_num;c++) class_start[c+1] += class_start[c];
+
+    int* perm = (int*)malloc(length * sizeof(int));
+    int* fill = (int*)malloc(class_num * sizeof(int));
+    memcpy(fill, class_start, class_num * sizeof(int));
+    struct YoloV5Box* grouped = (struct YoloV5Box*)malloc(length * sizeof(struct YoloV5Box));
+    for (int i=0;i<length;i++){
+        int k = fill[dets[i].class_id]++;
+        perm[k] = i;
+        grouped[k] = dets[i];
+    }
+
+    // biggest classes first, so a large class does not start last
+    int task_num = 0;
+    int* task_class = fill;
+    for (int c=0;c<class_num;c++){
+        if (class_start[c+1] > class_start[c]) task_class[task_num++] = c;
+    }
+    for (int i=1;i<task_num;i++){
+        int c = task_class[i], n = class_start[c+1] - class_start[c];
+        int j = i - 1;
+        while (j >= 0 && class_start[task_class[j]+1] - class_start[task_class[j]] < n){
+            task_class[j+1] = task_class[j];
+            j--;
+        }
+        task_class[j+1] = c;
+    }
+
+    bool* grouped_keep = (bool*)malloc(length * sizeof(bool));
+    memset(grouped_keep, true, length * sizeof(bool));
+    struct nms_class_job job = {mode, grouped, grouped_keep, nmsConfidence, score_thresh, class_start, task_class};
+    thread_pool_run(pool, nms_class_task, &job, task_num);
+
+    for (int k=0;k<length;k++){
+        keep[perm[k]] = grouped_keep[k];
+        dets[perm[k]].score = grouped[k].score;
+    }
+    free(grouped_keep);
+    free(grouped);
+    free(fill);
+    free(perm);
+    free(class_start);
+}
+#endif
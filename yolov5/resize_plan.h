@@ -0,0 +1,194 @@
+#ifndef RESIZE_PLAN_H
+#define RESIZE_PLAN_H
+
+#ifndef STB_IMAGE_RESIZE_IMPLEMENTATION
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include "stb/stb_image_resize2.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+#define RESIZE_PLAN_CACHE_SIZE 4
+
+// kind of source image a plan samples from
+enum plan_src {
+    PLAN_SRC_RGB,
+    PLAN_SRC_NV12,
+    PLAN_SRC_I420,
+};
+
+struct yuv_tap;
+
+// everything pre_process needs that only depends on the geometry,
+// built on the first frame and reused by the following ones
+struct resize_plan {
+    // key
+    int ori_w;
+    int ori_h;
+    int net_w;
+    int net_h;
+    bool keep_aspect;
+    enum plan_src src;
+
+    // letterbox
+    int target_w;
+    int target_h;
+    int start_x;
+    int start_y;
+    float ratio_x;
+    float ratio_y;
+
+    // rgb source: stb samplers and the resized hwc image
+    STBIR_RESIZE resize;
+    unsigned char* resized_img;
+    int splits;     // horizontal bands the samplers were built for
+
+    // yuv source: horizontal taps of luma and chroma, and the y, u and v
+    // row buffers of each band
+    struct yuv_tap* taps;
+    float* rows;
+    int row_bands;  // bands rows has room for
+
+    unsigned last_use;
+    bool valid;
+};
+
+// letterbox border last written into the input buffer, kept across frames
+struct letterbox_pad {
+    float value;
+    const float* buf;
+    int net_w;
+    int net_h;
+    int start_x;
+    int start_y;
+    int target_w;
+    int target_h;
+    bool dirty;     // border changed since the last full upload
+};
+
+struct resize_plan_cache {
+    struct resize_plan plans[RESIZE_PLAN_CACHE_SIZE];
+    unsigned tick;
+    int splits;     // bands to try when building samplers, one per thread
+    struct letterbox_pad pad;
+};
+
+// pad_value is in pixel units, e.g. 114
+void resize_plan_cache_init(struct resize_plan_cache* cache, int splits, int pad_value){
+    memset(cache, 0, sizeof(*cache));
+    cache->splits = splits < 1 ? 1 : splits;
+    cache->pad.value = pad_value / 255.0f;
+}
+
+void resize_plan_release(struct resize_plan* plan){
+    if (!plan->valid) return;
+    if (plan->src == PLAN_SRC_RGB){
+        stbir_free_samplers(&plan->resize);
+        free(plan->resized_img);
+    }
+    free(plan->taps);
+    free(plan->rows);
+    memset(plan, 0, sizeof(*plan));
+}
+
+void resize_plan_cache_free(struct resize_plan_cache* cache){
+    for (int i=0;i<RESIZE_PLAN_CACHE_SIZE;i++){
+        resize_plan_release(&cache->plans[i]);
+    }
+}
+
+bool resize_plan_match(const struct resize_plan* plan, const struct resize_info* r, enum plan_src src){
+    return plan->valid && plan->src == src
+        && plan->ori_w == r->ori_w && plan->ori_h == r->ori_h
+        && plan->net_w == r->net_w && plan->net_h == r->net_h
+        && plan->keep_aspect == r->keep_aspect;
+}
+
+// fill the border around the active region of the CHW input_data, skipped
+// when the buffer and the geometry are the same as for the previous frame
+void letterbox_pad_fill(struct letterbox_pad* pad, float* input_data, const struct resize_plan* plan){
+    if (pad->buf == input_data && pad->net_w == plan->net_w && pad->net_h == plan->net_h
+            && pad->start_x == plan->start_x && pad->start_y == plan->start_y
+            && pad->target_w == plan->target_w && pad->target_h == plan->target_h)
+        return;
+
+    int channels = 3;
+    int net_w = plan->net_w, net_h = plan->net_h;
+    int right_x = plan->start_x + plan->target_w;
+    int bottom_y = plan->start_y + plan->target_h;
+    for (int k=0;k<channels;k++){
+        float* plane = input_data + k * net_w * net_h;
+        for (int i=0;i<net_h;i++){
+            float* row = plane + i * net_w;
+            if (i < plan->start_y || i >= bottom_y){
+                for (int j=0;j<net_w;j++) row[j] = pad->value;
+            } else {
+                for (int j=0;j<plan->start_x;j++) row[j] = pad->value;
+                for (int j=right_x;j<net_w;j++) row[j] = pad->value;
+            }
+        }
+    }
+
+    pad->buf = input_data;
+    pad->net_w = net_w;
+    pad->net_h = net_h;
+    pad->start_x = plan->start_x;
+    pad->start_y = plan->start_y;
+    pad->target_w = plan->target_w;
+    pad->target_h = plan->target_h;
+    pad->dirty = true;
+}
+
+// find or build the plan for r, and apply its letterbox geometry to r
+struct resize_plan* resize_plan_get(struct resize_plan_cache* cache, struct resize_info* r, enum plan_src src){
+    struct resize_plan* plan = NULL;
+    cache->tick++;
+    for (int i=0;i<RESIZE_PLAN_CACHE_SIZE;i++){
+        if (resize_plan_match(&cache->plans[i], r, src)){
+            plan = &cache->plans[i];
+            break;
+        }
+    }
+
+    if (plan == NULL){
+        // evict the least recently used plan
+        plan = &cache->plans[0];
+        for (int i=1;i<RESIZE_PLAN_CACHE_SIZE && plan->valid;i++){
+            if (!cache->plans[i].valid || cache->plans[i].last_use < plan->last_use)
+                plan = &cache->plans[i];
+        }
+        resize_plan_release(plan);
+
+        plan->ori_w = r->ori_w;
+        plan->ori_h = r->ori_h;
+        plan->net_w = r->net_w;
+        plan->net_h = r->net_h;
+        plan->keep_aspect = r->keep_aspect;
+        plan->src = src;
+
+        get_letterbox(r, &plan->target_w, &plan->target_h);
+        plan->start_x = r->start_x;
+        plan->start_y = r->start_y;
+        plan->ratio_x = r->ratio_x;
+        plan->ratio_y = r->ratio_y;
+
+        if (src == PLAN_SRC_RGB){
+            int channels = 3;
+            plan->resized_img = (unsigned char*)malloc(plan->target_w * plan->target_h * channels);
+            stbir_resize_init(&plan->resize, NULL, r->ori_w, r->ori_h, 0,
+                    plan->resized_img, plan->target_w, plan->target_h, 0, STBIR_RGB, STBIR_TYPE_UINT8);
+            plan->splits = stbir_build_samplers_with_splits(&plan->resize, cache->splits);
+        }
+        plan->valid = true;
+    }
+
+    plan->last_use = cache->tick;
+    r->start_x = plan->start_x;
+    r->start_y = plan->start_y;
+    r->ratio_x = plan->ratio_x;
+    r->ratio_y = plan->ratio_y;
+    return plan;
+}
+#endif
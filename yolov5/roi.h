@@ -0,0 +1,45 @@
+#ifndef ROI_H
+#define ROI_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// region of interest of a stream in frame pixels, run instead of the
+// whole frame so the net sees it at a higher resolution
+struct roi {
+    int x;
+    int y;
+    int w;
+    int h;
+};
+
+// append a region given as x,y,WxH to rois
+bool roi_parse(const char* str, struct roi** rois, int* num){
+    struct roi r;
+    if (sscanf(str, "%d,%d,%dx%d", &r.x, &r.y, &r.w, &r.h) != 4
+            || r.x < 0 || r.y < 0 || r.w < 1 || r.h < 1)
+        return false;
+    *rois = (struct roi*)realloc(*rois, (*num + 1) * sizeof(struct roi));
+    (*rois)[(*num)++] = r;
+    return true;
+}
+
+// the part of the region inside a width x height frame, with an even
+// corner when even is set. returns false if nothing of it is left
+bool roi_clip(const struct roi* r, int width, int height, bool even, struct roi* out){
+    int x0 = r->x, y0 = r->y;
+    int x1 = r->x + r->w, y1 = r->y + r->h;
+    if (even){
+        x0 &= ~1;
+        y0 &= ~1;
+    }
+    if (x1 > width) x1 = width;
+    if (y1 > height) y1 = height;
+    if (x1 <= x0 || y1 <= y0) return false;
+    out->x = x0;
+    out->y = y0;
+    out->w = x1 - x0;
+    out->h = y1 - y0;
+    return true;
+}
+#endif
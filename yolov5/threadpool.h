@@ -0,0 +1,112 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// task i of a parallel job, called once for every i in [0, task_num)
+typedef void (*thread_task_fn)(void* arg, int i);
+
+// fixed set of workers running one parallel-for job at a time,
+// the calling thread takes tasks too
+struct thread_pool {
+    pthread_t* threads;
+    int num;                // workers + the caller
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    thread_task_fn fn;
+    void* arg;
+    int task_num;
+    int next_task;
+    int done_tasks;
+    unsigned generation;
+    bool stop;
+};
+
+// take tasks of the current job until none are left
+void thread_pool_work(struct thread_pool* pool){
+    while (true){
+        int i = pool->next_task++;
+        if (i >= pool->task_num) break;
+        thread_task_fn fn = pool->fn;
+        void* arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+        fn(arg, i);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->done_tasks == pool->task_num)
+            pthread_cond_broadcast(&pool->done_cond);
+    }
+}
+
+void* thread_pool_worker(void* p){
+    struct thread_pool* pool = (struct thread_pool*)p;
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (true){
+        while (!pool->stop && pool->generation == seen)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->stop) break;
+        seen = pool->generation;
+        thread_pool_work(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// num is the total parallelism, num <= 1 gives no pool and serial runs
+struct thread_pool* thread_pool_create(int num){
+    if (num <= 1) return NULL;
+    struct thread_pool* pool = (struct thread_pool*)calloc(1, sizeof(struct thread_pool));
+    pool->num = num;
+    pool->threads = (pthread_t*)malloc((num-1) * sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    for (int i=0;i<num-1;i++){
+        pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool);
+    }
+    return pool;
+}
+
+// run fn(arg, i) for i in [0, task_num) and wait for all of them
+void thread_pool_run(struct thread_pool* pool, thread_task_fn fn, void* arg, int task_num){
+    if (pool == NULL || task_num <= 1){
+        for (int i=0;i<task_num;i++) fn(arg, i);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->task_num = task_num;
+    pool->next_task = 0;
+    pool->done_tasks = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    thread_pool_work(pool);
+    while (pool->done_tasks < pool->task_num)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int thread_pool_size(const struct thread_pool* pool){
+    return pool == NULL ? 1 : pool->num;
+}
+
+void thread_pool_destroy(struct thread_pool* pool){
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i=0;i<pool->num-1;i++){
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->threads);
+    free(pool);
+}
+#endif
@@ -0,0 +1,180 @@
+#ifndef TILE_H
+#define TILE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "yolov5.h"
+#include "net.h"
+
+// overlapping net sized views of an image larger than the net, fed to the
+// net 1:1 so small objects keep their pixels
+struct tile_grid {
+    int width;
+    int height;
+    int tile_w;     // net size, or the image size if it is smaller
+    int tile_h;
+    int nx;
+    int ny;
+    int* xs;        // left of each column
+    int* ys;        // top of each row
+};
+
+// evenly spaced views of size tile over size pixels, the first flush with
+// the start and the last with the end, neighbours overlap by at least
+// overlap. fills pos if not NULL, returns the number of views
+int tile_positions(int size, int tile, int overlap, int* pos){
+    int num = 1;
+    if (size > tile)
+        num = (size - overlap + (tile - overlap) - 1) / (tile - overlap);
+    if (pos != NULL){
+        for (int i=0;i<num;i++)
+            pos[i] = num == 1 ? 0 : (int)((long long)i * (size - tile) / (num - 1));
+    }
+    return num;
+}
+
+void tile_grid_init(struct tile_grid* grid, int width, int height, int net_w, int net_h, int overlap){
+    grid->width = width;
+    grid->height = height;
+    grid->tile_w = width < net_w ? width : net_w;
+    grid->tile_h = height < net_h ? height : net_h;
+    grid->nx = tile_positions(width, grid->tile_w, overlap, NULL);
+    grid->ny = tile_positions(height, grid->tile_h, overlap, NULL);
+    grid->xs = (int*)malloc(grid->nx * sizeof(int));
+    grid->ys = (int*)malloc(grid->ny * sizeof(int));
+    tile_positions(width, grid->tile_w, overlap, grid->xs);
+    tile_positions(height, grid->tile_h, overlap, grid->ys);
+}
+
+void tile_grid_free(struct tile_grid* grid){
+    free(grid->xs);
+    free(grid->ys);
+}
+
+int tile_count(const struct tile_grid* grid){
+    return grid->nx * grid->ny;
+}
+
+// geometry of tile i, row by row, as a 1:1 view of the image
+void tile_view(const struct tile_grid* grid, int i, int net_w, int net_h, struct resize_info* r){
+    r->ori_w = grid->tile_w;
+    r->ori_h = grid->tile_h;
+    r->net_w = net_w;
+    r->net_h = net_h;
+    r->ratio_x = 1;
+    r->ratio_y = 1;
+    r->start_x = 0;
+    r->start_y = 0;
+    r->keep_aspect = false;
+    r->view_x = grid->xs[i % grid->nx];
+    r->view_y = grid->ys[i / grid->nx];
+}
+
+struct tile_job {
+    const unsigned char* img;
+    const struct tile_grid* grid;
+    int first;          // tile of batch item 0
+    float* input_data;
+    size_t item_size;   // floats of one batch item
+    int net_w;
+    int net_h;
+    float pad_value;
+};
+
+// copy tile first+b into batch item b, straight from the decoded image
+void tile_task(void* arg, int b){
+    struct tile_job* job = (struct tile_job*)arg;
+    const struct tile_grid* grid = job->grid;
+    struct resize_info r;
+    tile_view(grid, job->first + b, job->net_w, job->net_h, &r);
+    float* input_data = job->input_data + b * job->item_size;
+
+    // pad the part of the net a tile of a small image does not cover
+    if (grid->tile_w < job->net_w || grid->tile_h < job->net_h){
+        for (int k=0;k<3;k++){
+            float* plane = input_data + k * job->net_w * job->net_h;
+            for (int i=0;i<job->net_h;i++){
+                int j = i < grid->tile_h ? grid->tile_w : 0;
+                for (;j<job->net_w;j++) plane[i * job->net_w + j] = job->pad_value;
+            }
+        }
+    }
+
+    int stride = grid->width * 3;
+    const unsigned char* view = job->img + r.view_y * stride + r.view_x * 3;
+    hwc_to_chw(view, stride, grid->tile_w, 0, grid->tile_h, input_data, &r);
+}
+
+// merge the detections of all tiles, boxes cut by a tile border and the
+// copies of overlapping tiles are fused by WBF or suppressed by the NMS
+// backend of params. returns the number of boxes left
+int tile_merge(const struct yolov5_params* params, struct YoloV5Box* boxes, int num, bool wbf){
+    if (wbf){
+        num = WBF(boxes, params->nms_thresh, num);
+    } else {
+        bool* keep = (bool*)malloc(num * sizeof(bool));
+        memset(keep, true, num * sizeof(bool));
+        float score_thresh = params->classes.num > 0 ? params->classes.min_thresh : params->conf_thresh;
+        if (params->parallel_nms)
+            nms_run_parallel(params->pool, params->nms_mode, boxes, keep, params->nms_thresh, score_thresh, num);
+        else
+            nms_run(params->nms_mode, boxes, keep, params->nms_thresh, score_thresh, num);
+        int det_num = 0;
+        for (int i=0;i<num;i++){
+            if (keep[i]) boxes[det_num++] = boxes[i];
+        }
+        free(keep);
+        num = det_num;
+    }
+    return yolov5_max_det(params, boxes, num);
+}
+
+// detect on the overlapping tiles of img, net->batch tiles per launch,
+// returns det_num boxes in image coordinates to free
+struct YoloV5Box* detect_tiled(struct bm_net* net, const struct yolov5_model* model,
+        const struct yolov5_params* params, const unsigned char* img, int width, int height,
+        int overlap, float pad_value, bool wbf, int* det_num){
+    struct tile_grid grid;
+    tile_grid_init(&grid, width, height, model->net_w, model->net_h, overlap);
+    int tile_num = tile_count(&grid);
+    printf("tiles: %d x %d of %dx%d, %d launches\n", grid.nx, grid.ny, grid.tile_w, grid.tile_h,
+            (tile_num + net->batch - 1) / net->batch);
+
+    // max_det applies to the merged boxes
+    struct yolov5_params tile_params = *params;
+    tile_params.max_det = 0;
+
+    int num = 0, cap = tile_num;
+    struct YoloV5Box* boxes = (struct YoloV5Box*)malloc(cap * sizeof(struct YoloV5Box));
+    struct tile_job job = {img, &grid, 0, net->input_data, bm_net_input_count(net),
+            model->net_w, model->net_h, pad_value};
+    for (int first=0;first<tile_num;first+=net->batch){
+        int n = tile_num - first < net->batch ? tile_num - first : net->batch;
+        job.first = first;
+        thread_pool_run(params->pool, tile_task, &job, n);
+        bm_net_upload(net);
+        bm_net_forward(net);
+
+        for (int b=0;b<n;b++){
+            struct yolov5_output outputs[YOLOV5_MAX_HEADS];
+            struct resize_info r;
+            bm_net_yolov5_outputs(net, b, outputs);
+            tile_view(&grid, first + b, model->net_w, model->net_h, &r);
+            int k;
+            struct YoloV5Box* tile_boxes = yolov5_detect(outputs, model, &tile_params, &r, &k);
+            if (num + k > cap){
+                cap = (num + k) * 2;
+                boxes = (struct YoloV5Box*)realloc(boxes, cap * sizeof(struct YoloV5Box));
+            }
+            memcpy(boxes + num, tile_boxes, k * sizeof(struct YoloV5Box));
+            num += k;
+            free(tile_boxes);
+        }
+        bm_net_release_outputs(net);
+    }
+    tile_grid_free(&grid);
+
+    *det_num = tile_merge(params, boxes, num, wbf);
+    return boxes;
+}
+#endif
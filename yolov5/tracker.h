@@ -0,0 +1,222 @@
+#ifndef TRACKER_H
+#define TRACKER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+
+#define TRACK_IOU_THRESH    0.3f    // least IoU of a detection with a track to match it
+#define TRACK_DECAY         0.95f   // confidence kept per frame without a detection
+#define TRACK_MAX_MISSES    2       // detector runs a track may miss before it is dropped
+#define TRACK_STD_POS       (1.0f / 20)     // noise relative to the box size
+#define TRACK_STD_VEL       (1.0f / 160)
+#define TRACK_MAX_STD       0.3f    // center std relative to the box size that calls for a detection
+
+// constant velocity kalman filter of one box coordinate. with a diagonal
+// process and measurement noise the covariance of a box state stays block
+// diagonal per coordinate, so four 2x2 filters are the full filter
+struct kalman1 {
+    float p;            // position
+    float v;            // velocity per frame
+    float p00, p01, p11;
+};
+
+void kalman1_init(struct kalman1* k, float z, float size){
+    float sp = 2 * TRACK_STD_POS * size, sv = 10 * TRACK_STD_VEL * size;
+    k->p = z;
+    k->v = 0;
+    k->p00 = sp * sp;
+    k->p01 = 0;
+    k->p11 = sv * sv;
+}
+
+void kalman1_predict(struct kalman1* k, float size){
+    float qp = TRACK_STD_POS * size, qv = TRACK_STD_VEL * size;
+    k->p += k->v;
+    k->p00 += 2 * k->p01 + k->p11 + qp * qp;
+    k->p01 += k->p11;
+    k->p11 += qv * qv;
+}
+
+// variance of the position after the next predict
+float kalman1_next_var(const struct kalman1* k, float size){
+    float qp = TRACK_STD_POS * size;
+    return k->p00 + 2 * k->p01 + k->p11 + qp * qp;
+}
+
+void kalman1_update(struct kalman1* k, float z, float size){
+    float r = TRACK_STD_POS * size;
+    float s = k->p00 + r * r;
+    float k0 = k->p00 / s, k1 = k->p01 / s;
+    float y = z - k->p;
+    k->p += k0 * y;
+    k->v += k1 * y;
+    k->p11 -= k1 * k->p01;
+    k->p01 -= k0 * k->p01;
+    k->p00 -= k0 * k->p00;
+}
+
+struct track {
+    int id;
+    unsigned class_id;
+    struct kalman1 cx, cy, w, h;
+    float score;        // score of the last detection, decayed by the frames since
+    int misses;         // detector runs in a row without a match
+};
+
+// SORT style tracker: detections of the keyframes are matched to the
+// predicted tracks by IoU, the frames between them are predicted only
+struct tracker {
+    struct track* tracks;
+    int num;
+    int cap;
+    int next_id;
+    int interval;       // frames from a keyframe to the next at most
+    int since_detect;   // frames since the last keyframe
+    int keyframes;
+    int frames;
+};
+
+void tracker_init(struct tracker* t, int interval){
+    memset(t, 0, sizeof(*t));
+    t->interval = interval;
+    t->since_detect = interval;
+}
+
+void tracker_free(struct tracker* t){
+    free(t->tracks);
+}
+
+// whether the detector should run on the next frame: the interval is up,
+// or the predicted center of a track would be too uncertain to match it,
+// as for a new track whose velocity is not known yet
+bool tracker_need_detect(const struct tracker* t){
+    if (t->since_detect + 1 >= t->interval) return true;
+    for (int i=0;i<t->num;i++){
+        const struct track* tr = &t->tracks[i];
+        if (tr->misses > 0) continue;
+        float w = tr->w.p, h = tr->h.p;
+        if (kalman1_next_var(&tr->cx, w) > TRACK_MAX_STD * TRACK_MAX_STD * w * w
+                || kalman1_next_var(&tr->cy, h) > TRACK_MAX_STD * TRACK_MAX_STD * h * h)
+            return true;
+    }
+    return false;
+}
+
+void track_box(const struct track* tr, struct YoloV5Box* box){
+    box->w = tr->w.p > 0 ? tr->w.p : 0;
+    box->h = tr->h.p > 0 ? tr->h.p : 0;
+    box->x = tr->cx.p - box->w / 2;
+    box->y = tr->cy.p - box->h / 2;
+    box->score = tr->score;
+    box->class_id = tr->class_id;
+}
+
+// advance all tracks by one frame
+void tracker_predict(struct tracker* t){
+    for (int i=0;i<t->num;i++){
+        struct track* tr = &t->tracks[i];
+        float w = tr->w.p, h = tr->h.p;
+        kalman1_predict(&tr->cx, w);
+        kalman1_predict(&tr->cy, h);
+        kalman1_predict(&tr->w, w);
+        kalman1_predict(&tr->h, h);
+        tr->score *= TRACK_DECAY;
+    }
+    t->since_detect++;
+    t->frames++;
+}
+
+struct track_pair {
+    float iou;
+    int track;
+    int det;
+};
+
+int compare_pair_iou_desc(const void* a, const void* b){
+    float ia = ((const struct track_pair*)a)->iou, ib = ((const struct track_pair*)b)->iou;
+    return (ia < ib) - (ia > ib);
+}
+
+// correct the predicted tracks with the detections of a keyframe, best
+// IoU first, start tracks of unmatched detections and drop tracks that
+// missed too many keyframes
+void tracker_update(struct tracker* t, const struct YoloV5Box* dets, int det_num){
+    struct track_pair* pairs = (struct track_pair*)malloc((t->num * det_num + 1) * sizeof(struct track_pair));
+    int pair_num = 0;
+    for (int i=0;i<t->num;i++){
+        struct YoloV5Box tb;
+        track_box(&t->tracks[i], &tb);
+        float ta = tb.w * tb.h;
+        for (int j=0;j<det_num;j++){
+            if (dets[j].class_id != tb.class_id) continue;
+            struct YoloV5Box db = dets[j];
+            float da = db.w * db.h;
+            float iou = calculate_iou(&tb, &db, &ta, &da);
+            if (iou >= TRACK_IOU_THRESH) pairs[pair_num++] = (struct track_pair){iou, i, j};
+        }
+    }
+    qsort(pairs, pair_num, sizeof(struct track_pair), compare_pair_iou_desc);
+
+    bool* track_used = (bool*)calloc(t->num + 1, sizeof(bool));
+    bool* det_used = (bool*)calloc(det_num + 1, sizeof(bool));
+    for (int k=0;k<pair_num;k++){
+        int i = pairs[k].track, j = pairs[k].det;
+        if (track_used[i] || det_used[j]) continue;
+        track_used[i] = det_used[j] = true;
+        struct track* tr = &t->tracks[i];
+        const struct YoloV5Box* d = &dets[j];
+        kalman1_update(&tr->cx, d->x + d->w / 2, d->w);
+        kalman1_update(&tr->cy, d->y + d->h / 2, d->h);
+        kalman1_update(&tr->w, d->w, d->w);
+        kalman1_update(&tr->h, d->h, d->h);
+        tr->score = d->score;
+        tr->misses = 0;
+    }
+
+    // drop the tracks that keep missing
+    int kept = 0;
+    for (int i=0;i<t->num;i++){
+        if (!track_used[i] && ++t->tracks[i].misses > TRACK_MAX_MISSES) continue;
+        t->tracks[kept++] = t->tracks[i];
+    }
+    t->num = kept;
+
+    for (int j=0;j<det_num;j++){
+        if (det_used[j]) continue;
+        if (t->num == t->cap){
+            t->cap = t->cap ? t->cap * 2 : 16;
+            t->tracks = (struct track*)realloc(t->tracks, t->cap * sizeof(struct track));
+        }
+        struct track* tr = &t->tracks[t->num++];
+        const struct YoloV5Box* d = &dets[j];
+        tr->id = t->next_id++;
+        tr->class_id = d->class_id;
+        kalman1_init(&tr->cx, d->x + d->w / 2, d->w);
+        kalman1_init(&tr->cy, d->y + d->h / 2, d->h);
+        kalman1_init(&tr->w, d->w, d->w);
+        kalman1_init(&tr->h, d->h, d->h);
+        tr->score = d->score;
+        tr->misses = 0;
+    }
+    free(det_used);
+    free(track_used);
+    free(pairs);
+    t->since_detect = 0;
+    t->keyframes++;
+}
+
+// boxes of the tracks matched on the last keyframe, clipped to the frame,
+// returns their number, boxes has room for t->num
+int tracker_boxes(const struct tracker* t, struct YoloV5Box* boxes, int width, int height){
+    int num = 0;
+    for (int i=0;i<t->num;i++){
+        if (t->tracks[i].misses > 0) continue;
+        track_box(&t->tracks[i], &boxes[num]);
+        fix_box(&boxes[num], width, height);
+        num++;
+    }
+    return num;
+}
+#endif
@@ -29,6 +29,12 @@ struct YoloV5Box {
     unsigned class_id;
 };
 
+// class of one detection given by the second stage model
+struct cascade_result {
+    int class_id;       // -1 if the box was too small to crop
+    float score;        // raw output of the class, as the model gives it
+};
+
 struct resize_info {
     int ori_w;
     int ori_h;
@@ -39,13 +45,91 @@ struct resize_info {
     int start_x;
     int start_y;
     bool keep_aspect;
+    int view_x;     // offset of the preprocessed view in the full image
+    int view_y;
 };
 
+// compute letterbox geometry, fill start_x/start_y and the resized target size
+void get_letterbox(struct resize_info* r, int* target_w, int* target_h){
+    *target_w = r->net_w;
+    *target_h = r->net_h;
+    if (r->keep_aspect){
+        if (r->ratio_x < r->ratio_y){
+            *target_h = (int)(r->ori_h * r->ratio_x);
+            r->start_y = (int)(r->net_h-*target_h)/2;
+            r->ratio_y = r->ratio_x;
+        } else {
+            *target_w = (int)(r->ori_w * r->ratio_y);
+            r->start_x = (int)(r->net_w-*target_w)/2;
+            r->ratio_x = r->ratio_y;
+        }
+    }
+}
+
 // sigmoid function
 float sigmoid(float x){
     return 1.0 / (1 + expf(-x));
 }
 
+// inverse of sigmoid, p is kept inside (0, 1)
+float logit(float p){
+    p = fminf(fmaxf(p, 1e-6f), 1 - 1e-6f);
+    return logf(p / (1 - p));
+}
+
+// ieee half precision to float
+float half_to_float(unsigned short h){
+    unsigned sign = (unsigned)(h & 0x8000) << 16;
+    unsigned exp = (h >> 10) & 0x1f;
+    unsigned mant = h & 0x3ff;
+    unsigned bits;
+    if (exp == 0){
+        if (mant == 0){
+            bits = sign;
+        } else {
+            // subnormal, normalize it
+            exp = 127 - 15 + 1;
+            while (!(mant & 0x400)){
+                mant <<= 1;
+                exp--;
+            }
+            bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else if (exp == 31){
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else {
+        bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// float to half, rounding toward zero
+unsigned short float_to_half(float f){
+    unsigned bits;
+    memcpy(&bits, &f, sizeof(bits));
+    unsigned short sign = (bits >> 16) & 0x8000;
+    int exp = (int)((bits >> 23) & 0xff) - 127 + 15;
+    unsigned mant = bits & 0x7fffff;
+    if (exp >= 31) return sign | 0x7bff;
+    if (exp <= 0){
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        return sign | (unsigned short)(mant >> (14 - exp));
+    }
+    return sign | (unsigned short)(exp << 10) | (unsigned short)(mant >> 13);
+}
+
+// map half bits to an int with the same ordering as the values
+int half_key(unsigned short h){
+    return (h & 0x8000) ? -(int)(h & 0x7fff) : (int)h;
+}
+
+unsigned short half_from_key(int key){
+    return key < 0 ? (unsigned short)(0x8000 | -key) : (unsigned short)key;
+}
+
 // argmax function
 void argmax(const float* data, int num, float* max_value, unsigned* max_index){
     for(int i = 1; i < num; ++i) {
@@ -64,12 +148,19 @@ void argmax_sse(const float* data, int num, float* max_value, unsigned *max_inde
     int32_t aMaxIndex[4];
     int i;
 
+    if (num < 4){
+        *max_value = data[0];
+        *max_index = 0;
+        argmax(data, num, max_value, max_index);
+        return;
+    }
+
     const __m128i vIndexInc = _mm_set1_epi32(4);
     __m128i vMaxIndex = _mm_setr_epi32(0, 1, 2, 3);
     __m128i vIndex = vMaxIndex;
     __m128 vMaxVal = _mm_loadu_ps(data);
 
-    for (i = 4; i < num; i += 4)
+    for (i = 4; i + 4 <= num; i += 4)
     {
         __m128 v = _mm_loadu_ps(&data[i]);
         __m128 vcmp = _mm_cmpgt_ps(v, vMaxVal);
@@ -81,12 +172,21 @@ void argmax_sse(const float* data, int num, float* max_value, unsigned *max_inde
     _mm_storeu_si128((__m128i *)aMaxIndex, vMaxIndex);
     *max_value = aMaxVal[0];
     *max_index = aMaxIndex[0];
-    for (i = 1; i < 4; ++i)
+    for (int j = 1; j < 4; ++j)
+    {
+        if (aMaxVal[j] > *max_value)
+        {
+            *max_value = aMaxVal[j];
+            *max_index = aMaxIndex[j];
+        }
+    }
+    // tail when num is not a multiple of 4
+    for (; i < num; ++i)
     {
-        if (aMaxVal[i] > *max_value)
+        if (data[i] > *max_value)
         {
-            *max_value = aMaxVal[i];
-            *max_index = aMaxIndex[i];
+            *max_value = data[i];
+            *max_index = i;
         }
     }
 }
@@ -149,6 +249,56 @@ void argmax_neon(const float *data, int num, float* max_value, unsigned* max_ind
 }
 #endif
 
+// write the index of every value above thresh to index, returns how many
+int compress_gt(const float* data, int num, float thresh, unsigned* index){
+    int n = 0;
+    for (int i = 0; i < num; ++i) {
+        if (data[i] > thresh) index[n++] = i;
+    }
+    return n;
+}
+
+#ifdef __SSE4_1__
+int compress_gt_sse(const float* data, int num, float thresh, unsigned* index){
+    __m128 vThresh = _mm_set1_ps(thresh);
+    int n = 0, i;
+    for (i = 0; i + 4 <= num; i += 4) {
+        int mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(&data[i]), vThresh));
+        // usually no lane passes, so the whole block is skipped
+        while (mask) {
+            index[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < num; ++i) {
+        if (data[i] > thresh) index[n++] = i;
+    }
+    return n;
+}
+#endif
+
+#ifdef __ARM_NEON
+int compress_gt_neon(const float* data, int num, float thresh, unsigned* index){
+    float32x4_t thresh_vec = vdupq_n_f32(thresh);
+    const uint32_t bits[4] = {1, 2, 4, 8};
+    uint32x4_t bit_vec = vld1q_u32(bits);
+    int n = 0, i;
+    for (i = 0; i + 4 <= num; i += 4) {
+        uint32x4_t m = vandq_u32(vcgtq_f32(vld1q_f32(data + i), thresh_vec), bit_vec);
+        uint32x2_t m2 = vorr_u32(vget_low_u32(m), vget_high_u32(m));
+        unsigned mask = vget_lane_u32(vpadd_u32(m2, m2), 0);
+        while (mask) {
+            index[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < num; ++i) {
+        if (data[i] > thresh) index[n++] = i;
+    }
+    return n;
+}
+#endif
+
 float calculate_iou(struct YoloV5Box* box1, struct YoloV5Box* box2, float* area1, float* area2) {
     float x1 = fmaxf(box1->x, box2->x);
     float y1 = fmaxf(box1->y, box2->y);
@@ -183,6 +333,38 @@ void NMS(struct YoloV5Box* dets, bool* keep, float nmsConfidence, int length){
     free(areas);
 }
 
+// reorder boxes so the k highest scores come first, in no particular
+// order, quickselect in O(num) on average. returns min(k, num)
+int select_top_k(struct YoloV5Box* boxes, int num, int k){
+    if (k <= 0 || k >= num) return num;
+    int lo = 0, hi = num - 1;
+    while (lo < hi){
+        // median of three as pivot
+        int mid = lo + (hi - lo) / 2;
+        float a = boxes[lo].score, b = boxes[mid].score, c = boxes[hi].score;
+        float pivot = a > b ? (b > c ? b : (a > c ? c : a)) : (a > c ? a : (b > c ? c : b));
+        int i = lo, j = hi;
+        while (i <= j){
+            while (boxes[i].score > pivot) i++;
+            while (boxes[j].score < pivot) j--;
+            if (i <= j){
+                struct YoloV5Box t = boxes[i];
+                boxes[i++] = boxes[j];
+                boxes[j--] = t;
+            }
+        }
+        if (k - 1 <= j) hi = j;
+        else if (k - 1 >= i) lo = i;
+        else break;
+    }
+    return k;
+}
+
+int compare_score_desc(const void* a, const void* b){
+    float sa = ((const struct YoloV5Box*)a)->score, sb = ((const struct YoloV5Box*)b)->score;
+    return (sa < sb) - (sa > sb);
+}
+
 // fix box
 void fix_box(struct YoloV5Box* box, int width, int height){
     box->w = fminf(fmaxf(box->w, 0), width );
@@ -18,11 +18,19 @@
 #include "stb/stb_image_write.h"
 #endif
 
+#include <bmruntime_interface.h>
 #include <sys/stat.h>
+#include <assert.h>
 #include <math.h>
 #include <string.h>
 #include "text2img.h"
 #include "utils.h"
+#include "model.h"
+#include "nms.h"
+#include "decode.h"
+#include "threadpool.h"
+#include "resize_plan.h"
+#include "yuv.h"
 
 const char* CLASS_NAMES[] = {
     "person", "bicycle", "car", "motorcycle", "airplane", "bus", "train", "truck", "boat", "traffic light",
@@ -35,145 +43,220 @@ const char* CLASS_NAMES[] = {
     "microwave", "oven", "toaster", "sink", "refrigerator", "book", "clock", "vase", "scissors", "teddy bear",
     "hair drier", "toothbrush"};
 
-void pre_process(const unsigned char* img, float* input_data, struct resize_info* r){
+// fill rows [row_begin, row_end) of input_data from resized_img, whose rows
+// are src_stride bytes apart. input data is CHW, but resized_img is HWC
+void hwc_to_chw(const unsigned char* resized_img, int src_stride, int target_w, int row_begin, int row_end,
+        float* input_data, const struct resize_info* r){
     int channels = 3;
-
-    // using stb_image_resize to resize
-    int target_w = r->net_w, target_h = r->net_h;
-    if (r->keep_aspect){
-        if (r->ratio_x < r->ratio_y){
-            target_h = (int)(r->ori_h * r->ratio_x);
-            r->start_y = (int)(r->net_h-target_h)/2;
-            r->ratio_y = r->ratio_x;
-        } else {
-            target_w = (int)(r->ori_w * r->ratio_y);
-            r->start_x = (int)(r->net_w-target_w)/2;
-            r->ratio_x = r->ratio_y;
-        }
-    }
-    unsigned char *resized_img = (unsigned char *)malloc(target_w * target_h * channels);
-    stbir_resize_uint8_linear(img, r->ori_w, r->ori_h, 0, resized_img, target_w, target_h, 0, STBIR_RGB);
-    //stbi_write_bmp("check.bmp", target_w, target_h, channels, (void*)resized_img);
-
-    // fill the input_data from resized_img
-    // input data is CHW, but resized_img is HWC
     float* input_temp0 = input_data + r->start_y * r->net_w + r->start_x;
-    unsigned temp_w = target_w*channels;
+    unsigned temp_w = src_stride;
     int net_area = r->net_w * r->net_h;
     for (int k=0;k<channels;k++){
         float* input_temp1 = input_temp0 + k*net_area;
-        unsigned char* r_temp1 = resized_img + k;
-        for (int i=0;i<target_h;i++){
+        const unsigned char* r_temp1 = resized_img + k;
+        for (int i=row_begin;i<row_end;i++){
             float* input_temp2 = input_temp1 + i*r->net_w;
-            unsigned char* r_temp2 = r_temp1 + i*temp_w;
+            const unsigned char* r_temp2 = r_temp1 + i*temp_w;
             for (int j=0;j<target_w;j++){
                 input_temp2[j] = (float)r_temp2[j*channels]/255.0;
             }
         }
     }
+}
+
+struct pre_process_job {
+    struct resize_plan* plan;
+    float* input_data;
+    const struct resize_info* r;
+};
+
+// resize one band of output rows, then convert the same rows to CHW
+void pre_process_band(void* arg, int split){
+    struct pre_process_job* job = (struct pre_process_job*)arg;
+    struct resize_plan* plan = job->plan;
+    int row_begin = 0, row_end = plan->target_h;
+    if (plan->splits > 1){
+        stbir_resize_extended_split(&plan->resize, split, 1);
+        row_begin = plan->resize.samplers->split_info[split].start_output_y;
+        row_end = plan->resize.samplers->split_info[split].end_output_y;
+    } else {
+        stbir_resize_extended(&plan->resize);
+    }
+    hwc_to_chw(plan->resized_img, plan->target_w * 3, plan->target_w, row_begin, row_end, job->input_data, job->r);
+}
 
-    free(resized_img);
+// img rows are img_stride bytes apart, 0 for a packed image. pool may be
+// NULL, then the resize runs on the calling thread
+void pre_process(const unsigned char* img, int img_stride, float* input_data, struct resize_info* r,
+        struct resize_plan_cache* cache, struct thread_pool* pool){
+    // letterbox geometry and stb samplers are built once per resolution
+    struct resize_plan* plan = resize_plan_get(cache, r, PLAN_SRC_RGB);
+    letterbox_pad_fill(&cache->pad, input_data, plan);
+
+    // using stb_image_resize to resize, split into bands when threaded
+    stbir_set_buffer_ptrs(&plan->resize, img, img_stride, plan->resized_img, 0);
+    struct pre_process_job job = {plan, input_data, r};
+    thread_pool_run(pool, pre_process_band, &job, plan->splits > 1 ? plan->splits : 1);
+    //stbi_write_bmp("check.bmp", plan->target_w, plan->target_h, 3, (void*)plan->resized_img);
+}
+
+// class names of the sidecar config, or the coco names
+const char* class_name(const struct yolov5_model* model, unsigned class_id){
+    if (model->class_names != NULL)
+        return model->class_names[class_id];
+    if (class_id < sizeof(CLASS_NAMES)/sizeof(CLASS_NAMES[0]))
+        return CLASS_NAMES[class_id];
+    return "unknown";
 }
 
-void post_process(float** output, const char* img_path, unsigned char* img,
-        struct resize_info* r_info){
-    float m_confThreshold = 0.5;
-
-    int anchors[3][3][2] = {
-        {{10, 13}, {16, 30}, {33, 23}},
-        {{30, 61}, {62, 45}, {59, 119}},
-        {{116, 90}, {156, 198}, {373, 326}}};
-    int box_size[3] = {80,40,20};
-    const int anchor_num = 3;
-    int output_num = 3;
-    int box_num = 25200; // 3*(80*80+40*40+20*20)
-    int nout = 85;
-    float* data = (float*)malloc(box_num*nout*sizeof(float));
-    float* dst = data;
-
-    for(int tidx = 0; tidx < output_num; ++tidx) {
-        int feat_h = box_size[tidx];
-        int feat_w = box_size[tidx];
-        int area = feat_h * feat_w;
-        int feature_size = area*nout;
-        for (int anchor_idx = 0; anchor_idx < anchor_num; anchor_idx++) {
-            float* ptr = output[tidx] + anchor_idx*feature_size;
-            for (int i = 0; i < area; i++) {
-                dst[0] = (sigmoid(ptr[0]) * 2 - 0.5 + i % feat_w) / feat_w * r_info->net_w;
-                dst[1] = (sigmoid(ptr[1]) * 2 - 0.5 + i / feat_w) / feat_h * r_info->net_h;
-                dst[2] = pow((sigmoid(ptr[2]) * 2), 2) * anchors[tidx][anchor_idx][0];
-                dst[3] = pow((sigmoid(ptr[3]) * 2), 2) * anchors[tidx][anchor_idx][1];
-                dst[4] = sigmoid(ptr[4]);
-                float score = dst[4];
-                if (score > m_confThreshold) {
-                    for(int d=5; d<nout; d++){
-                        dst[d] = sigmoid(ptr[d]);
-                    }
-                }
-                dst += nout;
-                ptr += nout;
+// parse an allow-list like "person:0.4,car,truck", classes without a
+// threshold use params->conf_thresh
+bool class_subset_parse(struct yolov5_params* params, const struct yolov5_model* model, const char* list){
+    struct class_subset* subset = &params->classes;
+    int class_num = model->class_num;
+    float* thresh = (float*)malloc(class_num * sizeof(float));
+    for (int c=0;c<class_num;c++) thresh[c] = -1;
+
+    char* buf = strdup(list);
+    for (char* tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")){
+        float t = params->conf_thresh;
+        char* colon = strrchr(tok, ':');
+        if (colon != NULL){
+            *colon = '\0';
+            char* end;
+            t = strtof(colon + 1, &end);
+            if (end == colon + 1 || t < 0 || t >= 1){
+                printf("bad threshold for class %s\n", trim(tok));
+                free(buf);
+                free(thresh);
+                return false;
             }
         }
+        char* name = trim(tok);
+        int c = 0;
+        while (c < class_num && strcmp(class_name(model, c), name) != 0) c++;
+        if (c == class_num){
+            printf("unknown class: %s\n", name);
+            free(buf);
+            free(thresh);
+            return false;
+        }
+        thresh[c] = t;
     }
+    free(buf);
 
-    int m_class_num = 80;
-    struct YoloV5Box* yolobox = (struct YoloV5Box*)malloc( box_num * sizeof(struct YoloV5Box));
-    int box_i = 0;
-    for (int i = 0; i < box_num; i++) {
-        float* ptr = data+i*nout;
-        float score = ptr[4];
-        if (score > m_confThreshold) {
-            unsigned class_id = 0;
-            float confidence = ptr[5];
-#if defined(__ARM_NEON)
-            argmax_neon(&ptr[5], m_class_num, &confidence, &class_id);
-#elif defined(__SSE4_1__)
-            argmax_sse(&ptr[5], m_class_num, &confidence, &class_id);
-#else
-            argmax(&ptr[5], m_class_num, &confidence, &class_id);
-#endif
-            float final_score = confidence * score;
-            if (final_score > m_confThreshold) {
-                struct YoloV5Box* box = &yolobox[box_i];
-                float w = ptr[2];
-                float h = ptr[3];
-                box->x = ptr[0] - w / 2;
-                box->y = ptr[1] - h / 2;
-                box->w = w;
-                box->h = h;
-                box->class_id = class_id;
-                box->score    = final_score;
-
-                box_i ++;
-            }
-        }
+    // keep the class order, so ties pick the same class as a full argmax
+    yolov5_params_free(params);
+    subset->ids = (int*)malloc(class_num * sizeof(int));
+    subset->thresh = (float*)malloc(class_num * sizeof(float));
+    subset->min_thresh = 1;
+    for (int c=0;c<class_num;c++){
+        if (thresh[c] < 0) continue;
+        subset->ids[subset->num] = c;
+        subset->thresh[subset->num++] = thresh[c];
+        if (thresh[c] < subset->min_thresh) subset->min_thresh = thresh[c];
+    }
+    free(thresh);
+    return subset->num > 0;
+}
+
+// keep the max_det best detections, best first, returns their number
+int yolov5_max_det(const struct yolov5_params* params, struct YoloV5Box* boxes, int num){
+    if (params->max_det > 0 && num > params->max_det){
+        num = select_top_k(boxes, num, params->max_det);
+        qsort(boxes, num, sizeof(struct YoloV5Box), compare_score_desc);
     }
-    free(data);
+    return num;
+}
+
+// decode the candidates of one batch item in network input pixels,
+// returns num boxes to free
+struct YoloV5Box* yolov5_decode(const struct yolov5_output* output, const struct yolov5_model* model,
+        const struct yolov5_params* params, int* num){
+    // decode on the pool, or with the specialized decoder of this geometry
+    // if there is one. class subsets and multi-label need the generic one,
+    // multi-label grows the list past box_num as classes pass
+    struct box_list list = {(struct YoloV5Box*)malloc(model->box_num * sizeof(struct YoloV5Box)), 0, model->box_num};
+    if (params->parallel_decode && thread_pool_size(params->pool) > 1)
+        decode_parallel(output, model, params, &list);
+    else if (model->decode != NULL && params->classes.num == 0 && !params->multi_label)
+        list.num = model->decode(output, model, params, list.boxes);
+    else
+        decode_generic(output, model, params, &list);
+    *num = list.num;
+    return list.boxes;
+}
+
+// cap, NMS and max_det on num candidates in place, returns the number kept
+int yolov5_select(const struct yolov5_params* params, struct YoloV5Box* yolobox, int box_i){
+    // cap the candidates, so the quadratic NMS has a bounded cost
+    if (params->max_candidates > 0)
+        box_i = select_top_k(yolobox, box_i, params->max_candidates);
 
     // doing NMS
-    float nmsConfidence = 0.6;
     bool* keep = (bool*)malloc(box_i*sizeof(bool));
     memset(keep, true, box_i*sizeof(bool));
-    NMS(yolobox, keep, nmsConfidence, box_i);
-    unsigned box_id = 0;
+    float score_thresh = params->classes.num > 0 ? params->classes.min_thresh : params->conf_thresh;
+    if (params->parallel_nms)
+        nms_run_parallel(params->pool, params->nms_mode, yolobox, keep, params->nms_thresh, score_thresh, box_i);
+    else
+        nms_run(params->nms_mode, yolobox, keep, params->nms_thresh, score_thresh, box_i);
+    int det_num = 0;
+    for (int i=0;i<box_i;i++){
+        if (keep[i]) yolobox[det_num++] = yolobox[i];
+    }
+    free(keep);
+
+    return yolov5_max_det(params, yolobox, det_num);
+}
+
+// decode, NMS and rescale to the full image, returns det_num boxes to free
+struct YoloV5Box* yolov5_detect(const struct yolov5_output* output, const struct yolov5_model* model,
+        const struct yolov5_params* params, const struct resize_info* r_info, int* det_num_out){
+    int box_i;
+    struct YoloV5Box* yolobox = yolov5_decode(output, model, params, &box_i);
+    int det_num = yolov5_select(params, yolobox, box_i);
+
+    // back to the preprocessed view, then to the full image
+    for (int i=0;i<det_num;i++){
+        struct YoloV5Box* box = &yolobox[i];
+        box->x = (box->x - r_info->start_x) / r_info->ratio_x;
+        box->y = (box->y - r_info->start_y) / r_info->ratio_y;
+        box->w = box->w / r_info->ratio_x;
+        box->h = box->h / r_info->ratio_y;
+        fix_box(box,r_info->ori_w,r_info->ori_h);
+        box->x += r_info->view_x;
+        box->y += r_info->view_y;
+    }
+    *det_num_out = det_num;
+    return yolobox;
+}
+
+// print the detections with their second stage class if classes is not
+// NULL, and draw them into img if there is one
+void yolov5_draw(const struct yolov5_model* model, const struct YoloV5Box* yolobox, int det_num,
+        const struct cascade_result* classes, unsigned char* img, int width, int height){
     size_t colors_num = sizeof(colors)/3/sizeof(int);
     // plot the rect on the img
-    for (int i=0;i<box_i;i++){
-        if (keep[i]){
-            struct YoloV5Box* box = &yolobox[i];
-            box->x = (box->x - r_info->start_x) / r_info->ratio_x;
-            box->y = (box->y - r_info->start_y) / r_info->ratio_y;
-            box->w = box->w / r_info->ratio_x;
-            box->h = box->h / r_info->ratio_y;
-            fix_box(box,r_info->ori_w,r_info->ori_h);
+    for (int i=0;i<det_num;i++){
+        const struct YoloV5Box* box = &yolobox[i];
+        if (img != NULL){
             int color_id = box->class_id % colors_num;
-            draw_rect(img,box,r_info->ori_w,colors[color_id]);
-            put_text(img, r_info->ori_w, r_info->ori_h, CLASS_NAMES[box->class_id], box->x, box->y, 0.5);
-            printf("class[%02d]: scores = %f, label = %s\n", box_id++,box->score,CLASS_NAMES[box->class_id]);
+            draw_rect(img,box,width,colors[color_id]);
+            put_text(img, width, height, class_name(model, box->class_id), box->x, box->y, 0.5);
         }
+        printf("class[%02d]: scores = %f, label = %s", i,box->score,class_name(model, box->class_id));
+        if (classes == NULL)
+            printf("\n");
+        else if (classes[i].class_id < 0)
+            printf(", cascade = too small\n");
+        else
+            printf(", cascade = %d (%f)\n", classes[i].class_id, classes[i].score);
     }
-    free(keep);
+}
 
+// save img to results/<name of img_path>.bmp
+void yolov5_save(const char* img_path, const unsigned char* img, int width, int height){
     // check whether results directory exists
     struct stat st = {0};
     if (stat("results", &st) == -1) {
@@ -191,10 +274,17 @@ void post_process(float** output, const char* img_path, unsigned char* img,
     strcpy(result_name, "results/");
     strcat(result_name, filename_without_extension);
     strcat(result_name, ".bmp");
-    stbi_write_bmp(result_name, r_info->ori_w, r_info->ori_h, 3, (void*)img);
+    stbi_write_bmp(result_name, width, height, 3, (void*)img);
     printf("Save result bmp to : %s\n", result_name);
+}
+
+// print the detections, and draw them into img and save it if there is one
+void yolov5_report(const struct yolov5_model* model, const struct YoloV5Box* yolobox, int det_num,
+        const char* img_path, unsigned char* img, int width, int height){
+    yolov5_draw(model, yolobox, det_num, NULL, img, width, height);
 
-    // free result box struct
-    free(yolobox);
+    // yuv frames have no rgb image to draw on
+    if (img != NULL)
+        yolov5_save(img_path, img, width, height);
 }
 #endif
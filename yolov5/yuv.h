@@ -0,0 +1,250 @@
+#ifndef YUV_H
+#define YUV_H
+
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+#include "utils.h"
+#include "threadpool.h"
+#include "resize_plan.h"
+
+// yuv420 layouts handed out by video decoders
+enum yuv_format {
+    YUV_NV12,   // Y plane + interleaved UV plane
+    YUV_I420,   // Y plane + U plane + V plane
+};
+
+// view of one yuv420 frame, planes are not copied
+struct yuv_frame {
+    const unsigned char* y;
+    const unsigned char* u;
+    const unsigned char* v;
+    int width;
+    int height;
+    int stride_y;
+    int stride_uv;
+    int uv_step;    // distance between two chroma samples, 2 for NV12, 1 for I420
+};
+
+// one horizontal bilinear tap, offsets are already multiplied by the sample step
+struct yuv_tap {
+    int x0;
+    int x1;
+    float fx;
+};
+
+// bytes of a tightly packed yuv420 frame
+size_t yuv_frame_size(int width, int height){
+    return (size_t)width * height + 2 * (size_t)((width+1)/2) * ((height+1)/2);
+}
+
+// wrap a tightly packed yuv420 buffer
+void yuv_frame_init(struct yuv_frame* f, const unsigned char* buf, int width, int height, enum yuv_format fmt){
+    int chroma_w = (width+1)/2;
+    int chroma_h = (height+1)/2;
+    f->y = buf;
+    f->width = width;
+    f->height = height;
+    f->stride_y = width;
+    if (fmt == YUV_NV12){
+        f->u = buf + (size_t)width * height;
+        f->v = f->u + 1;
+        f->stride_uv = 2 * chroma_w;
+        f->uv_step = 2;
+    } else {
+        f->u = buf + (size_t)width * height;
+        f->v = f->u + (size_t)chroma_w * chroma_h;
+        f->stride_uv = chroma_w;
+        f->uv_step = 1;
+    }
+}
+
+// view of the width x height rectangle at x, y of a frame, x and y even so
+// chroma samples stay aligned
+void yuv_frame_crop(struct yuv_frame* view, const struct yuv_frame* f, int x, int y, int width, int height){
+    *view = *f;
+    view->y = f->y + (size_t)y * f->stride_y + x;
+    view->u = f->u + (size_t)(y / 2) * f->stride_uv + (x / 2) * f->uv_step;
+    view->v = f->v + (size_t)(y / 2) * f->stride_uv + (x / 2) * f->uv_step;
+    view->width = width;
+    view->height = height;
+}
+
+// map dst pixel centers onto a src axis of length src_len, scale is src/dst
+void yuv_build_taps(struct yuv_tap* taps, int dst_len, int src_len, float scale, int step){
+    for (int i=0;i<dst_len;i++){
+        float s = (i + 0.5f) * scale - 0.5f;
+        if (s < 0) s = 0;
+        int x0 = (int)s;
+        float fx = s - x0;
+        if (x0 >= src_len - 1){
+            x0 = src_len - 1;
+            fx = 0;
+        }
+        int x1 = x0 + (x0 < src_len - 1);
+        taps[i].x0 = x0 * step;
+        taps[i].x1 = x1 * step;
+        taps[i].fx = fx;
+    }
+}
+
+// get the two source rows and the blend weight for output row i
+void yuv_row_pair(int i, int src_len, float scale, int* y0, int* y1, float* fy){
+    float s = (i + 0.5f) * scale - 0.5f;
+    if (s < 0) s = 0;
+    *y0 = (int)s;
+    *fy = s - *y0;
+    if (*y0 >= src_len - 1){
+        *y0 = src_len - 1;
+        *fy = 0;
+    }
+    *y1 = *y0 + (*y0 < src_len - 1);
+}
+
+// bilinear sample of one output row from two source rows
+void yuv_sample_row(const unsigned char* row0, const unsigned char* row1, float fy,
+        const struct yuv_tap* taps, float* dst, int n){
+    for (int i=0;i<n;i++){
+        const struct yuv_tap* t = taps + i;
+        float a = row0[t->x0] + (row0[t->x1] - row0[t->x0]) * t->fx;
+        float b = row1[t->x0] + (row1[t->x1] - row1[t->x0]) * t->fx;
+        dst[i] = a + (b - a) * fy;
+    }
+}
+
+// BT.601 limited range to rgb, already divided by 255
+#define YUV_KY   (1.164f / 255)
+#define YUV_KRV  (1.596f / 255)
+#define YUV_KGU  (-0.392f / 255)
+#define YUV_KGV  (-0.813f / 255)
+#define YUV_KBU  (2.017f / 255)
+
+// convert one row of sampled Y/U/V into the normalized R/G/B planes
+void yuv_row_to_rgb(const float* y, const float* u, const float* v,
+        float* r, float* g, float* b, int n){
+    int j = 0;
+#if defined(__SSE4_1__)
+    const __m128 vky = _mm_set1_ps(YUV_KY);
+    const __m128 vkrv = _mm_set1_ps(YUV_KRV);
+    const __m128 vkgu = _mm_set1_ps(YUV_KGU);
+    const __m128 vkgv = _mm_set1_ps(YUV_KGV);
+    const __m128 vkbu = _mm_set1_ps(YUV_KBU);
+    const __m128 v16 = _mm_set1_ps(16.0f);
+    const __m128 v128 = _mm_set1_ps(128.0f);
+    const __m128 vzero = _mm_setzero_ps();
+    const __m128 vone = _mm_set1_ps(1.0f);
+    for (; j + 4 <= n; j += 4){
+        __m128 c = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(y + j), v16), vky);
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(u + j), v128);
+        __m128 e = _mm_sub_ps(_mm_loadu_ps(v + j), v128);
+        __m128 vr = _mm_add_ps(c, _mm_mul_ps(e, vkrv));
+        __m128 vg = _mm_add_ps(c, _mm_add_ps(_mm_mul_ps(d, vkgu), _mm_mul_ps(e, vkgv)));
+        __m128 vb = _mm_add_ps(c, _mm_mul_ps(d, vkbu));
+        _mm_storeu_ps(r + j, _mm_min_ps(_mm_max_ps(vr, vzero), vone));
+        _mm_storeu_ps(g + j, _mm_min_ps(_mm_max_ps(vg, vzero), vone));
+        _mm_storeu_ps(b + j, _mm_min_ps(_mm_max_ps(vb, vzero), vone));
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t v16 = vdupq_n_f32(16.0f);
+    const float32x4_t v128 = vdupq_n_f32(128.0f);
+    const float32x4_t vzero = vdupq_n_f32(0.0f);
+    const float32x4_t vone = vdupq_n_f32(1.0f);
+    for (; j + 4 <= n; j += 4){
+        float32x4_t c = vmulq_n_f32(vsubq_f32(vld1q_f32(y + j), v16), YUV_KY);
+        float32x4_t d = vsubq_f32(vld1q_f32(u + j), v128);
+        float32x4_t e = vsubq_f32(vld1q_f32(v + j), v128);
+        float32x4_t vr = vmlaq_n_f32(c, e, YUV_KRV);
+        float32x4_t vg = vmlaq_n_f32(vmlaq_n_f32(c, d, YUV_KGU), e, YUV_KGV);
+        float32x4_t vb = vmlaq_n_f32(c, d, YUV_KBU);
+        vst1q_f32(r + j, vminq_f32(vmaxq_f32(vr, vzero), vone));
+        vst1q_f32(g + j, vminq_f32(vmaxq_f32(vg, vzero), vone));
+        vst1q_f32(b + j, vminq_f32(vmaxq_f32(vb, vzero), vone));
+    }
+#endif
+    for (; j < n; j++){
+        float c = (y[j] - 16.0f) * YUV_KY;
+        float d = u[j] - 128.0f;
+        float e = v[j] - 128.0f;
+        r[j] = fminf(fmaxf(c + e * YUV_KRV, 0.0f), 1.0f);
+        g[j] = fminf(fmaxf(c + d * YUV_KGU + e * YUV_KGV, 0.0f), 1.0f);
+        b[j] = fminf(fmaxf(c + d * YUV_KBU, 0.0f), 1.0f);
+    }
+}
+
+struct yuv_job {
+    const struct yuv_frame* f;
+    const struct resize_plan* plan;
+    float* input_data;
+    const struct resize_info* r;
+    int bands;
+};
+
+// convert one band of output rows, each band has its own row buffers in
+// the plan
+void pre_process_yuv_band(void* arg, int band){
+    struct yuv_job* job = (struct yuv_job*)arg;
+    const struct yuv_frame* f = job->f;
+    const struct resize_info* r = job->r;
+    int target_w = job->plan->target_w, target_h = job->plan->target_h;
+    int row_begin = target_h * band / job->bands;
+    int row_end = target_h * (band + 1) / job->bands;
+
+    int chroma_h = (f->height+1)/2;
+    float scale_y = (float)f->height / target_h;
+    const struct yuv_tap* taps_y = job->plan->taps;
+    const struct yuv_tap* taps_uv = taps_y + target_w;
+
+    float* row_y = job->plan->rows + (size_t)band * 3 * target_w;
+    float* row_u = row_y + target_w;
+    float* row_v = row_u + target_w;
+
+    int net_area = r->net_w * r->net_h;
+    float* input_temp0 = job->input_data + r->start_y * r->net_w + r->start_x;
+    for (int i=row_begin;i<row_end;i++){
+        int y0, y1;
+        float fy;
+        yuv_row_pair(i, f->height, scale_y, &y0, &y1, &fy);
+        yuv_sample_row(f->y + y0 * f->stride_y, f->y + y1 * f->stride_y, fy, taps_y, row_y, target_w);
+
+        yuv_row_pair(i, chroma_h, scale_y / 2, &y0, &y1, &fy);
+        yuv_sample_row(f->u + y0 * f->stride_uv, f->u + y1 * f->stride_uv, fy, taps_uv, row_u, target_w);
+        yuv_sample_row(f->v + y0 * f->stride_uv, f->v + y1 * f->stride_uv, fy, taps_uv, row_v, target_w);
+
+        float* dst = input_temp0 + i * r->net_w;
+        yuv_row_to_rgb(row_y, row_u, row_v, dst, dst + net_area, dst + 2 * net_area, target_w);
+    }
+}
+
+// letterbox resize + yuv->rgb + normalize straight into the CHW input_data,
+// only three row buffers per band are used, no rgb image is built
+void pre_process_yuv(const struct yuv_frame* f, float* input_data, struct resize_info* r,
+        struct resize_plan_cache* cache, struct thread_pool* pool){
+    // letterbox geometry and horizontal taps are built once per resolution
+    struct resize_plan* plan = resize_plan_get(cache, r, f->uv_step == 2 ? PLAN_SRC_NV12 : PLAN_SRC_I420);
+    letterbox_pad_fill(&cache->pad, input_data, plan);
+    int target_w = plan->target_w;
+
+    if (plan->taps == NULL){
+        int chroma_w = (f->width+1)/2;
+        float scale_x = (float)f->width / target_w;
+        plan->taps = (struct yuv_tap*)malloc(2 * target_w * sizeof(struct yuv_tap));
+        yuv_build_taps(plan->taps, target_w, f->width, scale_x, 1);
+        yuv_build_taps(plan->taps + target_w, target_w, chroma_w, scale_x / 2, f->uv_step);
+    }
+
+    struct yuv_job job = {f, plan, input_data, r, thread_pool_size(pool)};
+    if (plan->row_bands < job.bands){
+        free(plan->rows);
+        plan->rows = (float*)malloc((size_t)job.bands * 3 * target_w * sizeof(float));
+        plan->row_bands = job.bands;
+    }
+    thread_pool_run(pool, pre_process_yuv_band, &job, job.bands);
+}
+#endif